@@ -48,10 +48,78 @@ isregexc(int r)
 	return FALSE;
 }
 
+/*
+ * Line addresses from the buffer's newline counts rather than
+ * by reading every rune.  The answers are those of the loops
+ * in number, which are still used while t holds uncommitted text.
+ */
+static
+int
+linenumber(Text *t, Range *rp, int line, int dir)
+{
+	Buffer *b;
+	uint q0, q1, k, nl, nc;
+
+	b = &t->file->b;
+	nc = b->nc;
+	nl = bufnl(b, nc);
+	q0 = rp->q0;
+	q1 = rp->q1;
+	switch(dir){
+	case None:
+		q0 = 0;
+		q1 = 0;
+	Forward:
+		if(line <= 0)
+			break;
+		k = bufnl(b, q1);
+		if(line <= nl-k){
+			if(line > 1)
+				q0 = bufnlpos(b, k+line-1);
+			q1 = bufnlpos(b, k+line);
+		}else if(line==nl-k+1 && q1<nc && bufnlpos(b, nl)<nc){
+			/* the last line has no newline */
+			if(line > 1)
+				q0 = bufnlpos(b, nl);
+			q1 = nc;
+		}else
+			return FALSE;
+		break;
+	case Fore:
+		if(q1>0 && q1<nc && textreadc(t, q1-1)!='\n'){
+			k = bufnl(b, q1);
+			q1 = k<nl? bufnlpos(b, k+1) : nc;
+		}
+		q0 = q1;
+		goto Forward;
+	case Back:
+		if(q0 < nc)
+			q0 = bufnlpos(b, bufnl(b, q0));
+		q1 = q0;
+		k = bufnl(b, q0);
+		if(line <= 0)
+			q0 = bufnlpos(b, k);
+		else if(line <= k){
+			q1 = bufnlpos(b, k-line+1);
+			q0 = bufnlpos(b, k-line);
+		}else if(line == k+1){
+			/* :1-1 is :0 = #0, but :1-2 is an error */
+			if(k > 0)
+				q1 = bufnlpos(b, 1);
+			q0 = 0;
+		}else
+			return FALSE;
+	}
+	rp->q0 = q0;
+	rp->q1 = q1;
+	return TRUE;
+}
+
 Range
 number(uint showerr, Text *t, Range r, int line, int dir, int size, int *evalp)
 {
 	uint q0, q1;
+	Range nr;
 
 	if(size == Char){
 		if(dir == Fore)
@@ -66,6 +134,13 @@ number(uint showerr, Text *t, Range r, int line, int dir, int size, int *evalp)
 		*evalp = TRUE;
 		return range(line, line);
 	}
+	if(t->ncache == 0){
+		nr = r;
+		if(!linenumber(t, &nr, line, dir))
+			goto Rescue;
+		*evalp = TRUE;
+		return nr;
+	}
 	q0 = r.q0;
 	q1 = r.q1;
 	switch(dir){
@@ -120,27 +195,31 @@ regexp(uint showerr, Text *t, Range lim, Range r, Rune *pat, int dir, int *found
 {
 	int found;
 	Rangeset sel;
+	Regexp *re;
 	int q;
 
-	if(pat[0] == '\0' && rxnull()){
-		if(showerr)
-			warning(nil, "no previous regular expression\n");
-		*foundp = FALSE;
-		return r;
-	}
-	if(pat[0] && rxcompile(pat) == FALSE){
+	if(pat[0] == '\0'){
+		re = rxlast();
+		if(re == nil){
+			if(showerr)
+				warning(nil, "no previous regular expression\n");
+			*foundp = FALSE;
+			return r;
+		}
+	}else if((re = rxcompile(pat)) == nil){
 		*foundp = FALSE;
 		return r;
 	}
 	if(dir == Back)
-		found = rxbexecute(t, r.q0, &sel);
+		found = rxbexecute(re, t, r.q0, &sel);
 	else{
 		if(lim.q0 < 0)
 			q = Infinity;
 		else
 			q = lim.q1;
-		found = rxexecute(t, nil, r.q1, q, &sel);
+		found = rxexecute(re, t, nil, r.q1, q, &sel);
 	}
+	rxfree(re);
 	if(!found && showerr)
 		warning(nil, "no match for regexp\n");
 	*foundp = found;
@@ -13,9 +13,25 @@
 
 enum
 {
-	Slop = 100	/* room to grow with reallocation */
+	Slop = 100,	/* room to grow with reallocation */
+	Loadchunk = 256*1024,	/* bytes decoded by a loadproc at a time */
+	Parload = 4	/* default size, megabytes, for loading in parallel */
 };
 
+typedef struct Loadbuf Loadbuf;
+struct Loadbuf
+{
+	char    *p;      /* bytes to decode */
+	int     n;
+	Rune    *r;      /* what they decode to */
+	int     nr;
+	int     nulls;
+	Channel *done;   /* chan(Loadbuf*)[1]; returned here when decoded */
+};
+
+static	Channel	*cload;	/* chan(Loadbuf*); work for the loadprocs */
+static	int	nloadproc;
+
 static
 void
 sizecache(Buffer *b, uint n)
@@ -26,32 +42,247 @@ sizecache(Buffer *b, uint n)
 	b->c = runerealloc(b->c, b->cmax);
 }
 
+static	Bnode	*bnlist;	/* free Bnodes */
+static	QLock	bnlk;		/* editprocs share bnlist */
+
+static
+uint
+bsize(Bnode *p)
+{
+	if(p == nil)
+		return 0;
+	return p->nc;
+}
+
+static
+uint
+bnl(Bnode *p)
+{
+	if(p == nil)
+		return 0;
+	return p->nl;
+}
+
+static
+uint
+nlines(Rune *r, uint n)
+{
+	uint i, nl;
+
+	nl = 0;
+	for(i=0; i<n; i++)
+		if(r[i] == '\n')
+			nl++;
+	return nl;
+}
+
+/*
+ * Recompute the rune and newline counts of p and its ancestors.
+ * The counts of the cache block are stale while the cache
+ * is dirty, so flush calls this after writing it back.
+ */
+static
+void
+bfixup(Bnode *p)
+{
+	for(; p; p=p->up){
+		p->nc = bsize(p->left)+p->b->u.n+bsize(p->right);
+		p->nl = bnl(p->left)+p->lines+bnl(p->right);
+	}
+}
+
+/* rotate p above its parent */
+static
+void
+brotate(Buffer *b, Bnode *p)
+{
+	Bnode *q, *g;
+
+	q = p->up;
+	g = q->up;
+	if(q->left == p){
+		q->left = p->right;
+		if(p->right)
+			p->right->up = q;
+		p->right = q;
+	}else{
+		q->right = p->left;
+		if(p->left)
+			p->left->up = q;
+		p->left = q;
+	}
+	q->up = p;
+	p->up = g;
+	if(g == nil)
+		b->bt = p;
+	else if(g->left == q)
+		g->left = p;
+	else
+		g->right = p;
+	q->nc = bsize(q->left)+q->b->u.n+bsize(q->right);
+	q->nl = bnl(q->left)+q->lines+bnl(q->right);
+	p->nc = bsize(p->left)+p->b->u.n+bsize(p->right);
+	p->nl = bnl(p->left)+p->lines+bnl(p->right);
+}
+
+static
+Bnode*
+bnalloc(void)
+{
+	Bnode *p;
+	int j;
+
+	/* allocate in chunks to reduce malloc overhead */
+	qlock(&bnlk);
+	if(bnlist == nil){
+		bnlist = emalloc(100*sizeof(Bnode));
+		for(j=0; j<100-1; j++)
+			bnlist[j].up = &bnlist[j+1];
+	}
+	p = bnlist;
+	bnlist = p->up;
+	qunlock(&bnlk);
+	memset(p, 0, sizeof(Bnode));
+	return p;
+}
+
 static
 void
-addblock(Buffer *b, uint i, uint n)
+bnfree(Bnode *p)
+{
+	qlock(&bnlk);
+	p->up = bnlist;
+	bnlist = p;
+	qunlock(&bnlk);
+}
+
+/*
+ * Add block bl next to p: after it if after is set, otherwise
+ * before it.  p is nil only if the buffer has no blocks.
+ */
+static
+Bnode*
+addblock(Buffer *b, Bnode *p, int after, Block *bl)
 {
-	if(i > b->nbl)
+	Bnode *s;
+
+	if((p==nil) != (b->bt==nil))
 		error("internal error: addblock");
 
-	b->bl = realloc(b->bl, (b->nbl+1)*sizeof b->bl[0]);
-	if(i < b->nbl)
-		memmove(b->bl+i+1, b->bl+i, (b->nbl-i)*sizeof(Block*));
-	b->bl[i] = disknewblock(disk, n);
+	s = bnalloc();
+	s->b = bl;
+	s->pri = lrand();
+	if(p == nil)
+		b->bt = s;
+	else if(after){
+		if(p->right){
+			for(p=p->right; p->left; p=p->left)
+				;
+			p->left = s;
+		}else
+			p->right = s;
+	}else{
+		if(p->left){
+			for(p=p->left; p->right; p=p->right)
+				;
+			p->right = s;
+		}else
+			p->left = s;
+	}
+	s->up = p;
+	bfixup(s);
+	/* rotations preserve the counts of the ancestors */
+	while(s->up && s->up->pri<s->pri)
+		brotate(b, s);
 	b->nbl++;
+	return s;
 }
 
 static
 void
-delblock(Buffer *b, uint i)
+delblock(Buffer *b, Bnode *p)
 {
-	if(i >= b->nbl)
+	Bnode *c, *q;
+
+	if(p==nil || b->nbl==0)
 		error("internal error: delblock");
 
-	diskrelease(disk, b->bl[i]);
+	/* rotate p down to a leaf, then cut it off */
+	while(p->left || p->right){
+		if(p->right==nil || (p->left && p->left->pri>p->right->pri))
+			c = p->left;
+		else
+			c = p->right;
+		brotate(b, c);
+	}
+	q = p->up;
+	if(q == nil)
+		b->bt = nil;
+	else if(q->left == p)
+		q->left = nil;
+	else
+		q->right = nil;
+	bfixup(q);
+	diskrelease(disk, p->b);
+	bnfree(p);
 	b->nbl--;
-	if(i < b->nbl)
-		memmove(b->bl+i, b->bl+i+1, (b->nbl-i)*sizeof(Block*));
-	b->bl = realloc(b->bl, b->nbl*sizeof b->bl[0]);
+}
+
+static
+void
+freeblocks(Bnode *p)
+{
+	if(p == nil)
+		return;
+	freeblocks(p->left);
+	freeblocks(p->right);
+	diskrelease(disk, p->b);
+	bnfree(p);
+}
+
+static
+Bnode*
+lastblock(Buffer *b)
+{
+	Bnode *p;
+
+	p = b->bt;
+	if(p)
+		while(p->right)
+			p = p->right;
+	return p;
+}
+
+/*
+ * Find the block holding q0 and the position of its start.
+ * If q0 is at the very end, it is in the last block.
+ */
+static
+Bnode*
+findblock(Buffer *b, uint q0, uint *qp)
+{
+	Bnode *p;
+	uint q, n;
+
+	q = 0;
+	p = b->bt;
+	while(p){
+		n = bsize(p->left);
+		if(q0 < q+n){
+			p = p->left;
+			continue;
+		}
+		q += n;
+		n = p->b->u.n;
+		if(q0<q+n || q+n==b->nc){
+			*qp = q;
+			return p;
+		}
+		q += n;
+		p = p->right;
+	}
+	error("block not found");
+	return nil;
 }
 
 /*
@@ -63,11 +294,17 @@ static
 void
 flush(Buffer *b)
 {
+	if(b->cb == nil)
+		return;
 	if(b->cdirty || b->cnc==0){
-		if(b->cnc == 0)
-			delblock(b, b->cbi);
-		else
-			diskwrite(disk, &b->bl[b->cbi], b->c, b->cnc);
+		if(b->cnc == 0){
+			delblock(b, b->cb);
+			b->cb = nil;
+		}else{
+			diskwrite(disk, &b->cb->b, b->c, b->cnc);
+			b->cb->lines = nlines(b->c, b->cnc);
+			bfixup(b->cb);
+		}
 		b->cdirty = FALSE;
 	}
 }
@@ -76,8 +313,8 @@ static
 void
 setcache(Buffer *b, uint q0)
 {
-	Block **blp, *bl;
-	uint i, q;
+	Bnode *p;
+	uint q;
 
 	if(q0 > b->nc)
 		error("internal error: setcache");
@@ -87,41 +324,28 @@ setcache(Buffer *b, uint q0)
 	if(b->nc == 0 || (b->cq<=q0 && q0<b->cq+b->cnc))
 		return;
 	/*
-	 * if q0 is at end of file and end of cache, continue to grow this block
+	 * if q0 is at end of file and end of cache, continue to grow this block,
+	 * unless flush has released it for being empty
 	 */
-	if(q0==b->nc && q0==b->cq+b->cnc && b->cnc<Maxblock)
+	if(q0==b->nc && q0==b->cq+b->cnc && b->cnc<Maxblock && b->cb!=nil)
 		return;
 	flush(b);
 	/* find block */
-	if(q0 < b->cq){
-		q = 0;
-		i = 0;
-	}else{
-		q = b->cq;
-		i = b->cbi;
-	}
-	blp = &b->bl[i];
-	while(q+(*blp)->u.n <= q0 && q+(*blp)->u.n < b->nc){
-		q += (*blp)->u.n;
-		i++;
-		blp++;
-		if(i >= b->nbl)
-			error("block not found");
-	}
-	bl = *blp;
+	p = findblock(b, q0, &q);
 	/* remember position */
-	b->cbi = i;
+	b->cb = p;
 	b->cq = q;
-	sizecache(b, bl->u.n);
-	b->cnc = bl->u.n;
+	sizecache(b, p->b->u.n);
+	b->cnc = p->b->u.n;
 	/*read block*/
-	diskread(disk, bl, b->c, b->cnc);
+	diskread(disk, p->b, b->c, b->cnc);
 }
 
 void
 bufinsert(Buffer *b, uint q0, Rune *s, uint n)
 {
-	uint i, m, t, off;
+	uint m, t, off;
+	Bnode *p;
 
 	if(q0 > b->nc)
 		error("internal error: bufinsert");
@@ -133,11 +357,10 @@ bufinsert(Buffer *b, uint q0, Rune *s, uint n)
 			/* Everything fits in one block. */
 			t = b->cnc+n;
 			m = n;
-			if(b->bl == nil){	/* allocate */
+			if(b->bt == nil){	/* allocate */
 				if(b->cnc != 0)
 					error("internal error: bufinsert1 cnc!=0");
-				addblock(b, 0, t);
-				b->cbi = 0;
+				b->cb = addblock(b, nil, FALSE, disknewblock(disk, t));
 			}
 			sizecache(b, t);
 			runemove(b->c+off+m, b->c+off, b->cnc-off);
@@ -154,20 +377,18 @@ bufinsert(Buffer *b, uint q0, Rune *s, uint n)
 			if(b->cdirty)
 				flush(b);
 			m = min(n, Maxblock);
-			if(b->bl == nil){	/* allocate */
+			if(b->bt == nil){	/* allocate */
 				if(b->cnc != 0)
 					error("internal error: bufinsert2 cnc!=0");
-				i = 0;
-			}else{
-				i = b->cbi;
-				if(q0 > b->cq)
-					i++;
-			}
-			addblock(b, i, m);
+				p = addblock(b, nil, FALSE, disknewblock(disk, m));
+			}else if(b->cb == nil)	/* empty cache block was released; q0 is at end */
+				p = addblock(b, lastblock(b), TRUE, disknewblock(disk, m));
+			else
+				p = addblock(b, b->cb, q0>b->cq, disknewblock(disk, m));
 			sizecache(b, m);
 			runemove(b->c, s, m);
 			b->cq = q0;
-			b->cbi = i;
+			b->cb = p;
 			b->cnc = m;
 			goto Tail;
 		}
@@ -177,9 +398,10 @@ bufinsert(Buffer *b, uint q0, Rune *s, uint n)
 		 */
 		m = b->cnc-off;
 		if(m > 0){
-			i = b->cbi+1;
-			addblock(b, i, m);
-			diskwrite(disk, &b->bl[i], b->c+off, m);
+			p = addblock(b, b->cb, TRUE, disknewblock(disk, m));
+			diskwrite(disk, &p->b, b->c+off, m);
+			p->lines = nlines(b->c+off, m);
+			bfixup(p);
 			b->cnc -= m;
 		}
 		/*
@@ -268,11 +490,242 @@ loadfile(int fd, uint q0, int *nulls, int(*f)(void*, uint, Rune*, int), void *ar
 	return q1-q0;
 }
 
+/*
+ * Load a large file into an empty buffer without decoding it:
+ * each block refers to the bytes of the file it will hold and
+ * is decoded only when read.  The file is still scanned once,
+ * as the rune count of every block must be known.  Returns -1,
+ * having read nothing, if the file is not worth it.
+ */
+static
+int
+lazyload(Buffer *b, int fd, int *nulls)
+{
+	Dir *d;
+	Dfile *f;
+	Bnode *p;
+	uchar *s;
+	vlong off;
+	int eof, j, m, n, w, nr;
+	Rune r;
+
+	if(disk->lazy <= 0)
+		return -1;
+	d = dirfstat(fd);
+	if(d == nil)
+		return -1;
+	n = (d->qid.type&QTDIR) || d->length<(vlong)disk->lazy*1024*1024;
+	free(d);
+	off = seek(fd, 0, 1);
+	if(n || off<0 || (f=diskfileopen(disk, fd))==nil)
+		return -1;
+	s = emalloc(Maxblock*sizeof(Rune)+UTFmax+1);
+	p = nil;
+	m = 0;
+	eof = FALSE;
+	for(;;){
+		/* keep the buffer full, so only the end of file splits a rune */
+		while(!eof && m<Maxblock*sizeof(Rune)+UTFmax){
+			n = read(fd, s+m, Maxblock*sizeof(Rune)+UTFmax-m);
+			if(n < 0)
+				warning(nil, "read error in Buffer.load");
+			if(n <= 0)
+				eof = TRUE;
+			else
+				m += n;
+		}
+		if(m == 0)
+			break;
+		s[m] = 0;
+		/* count the runes cvttorunes would make */
+		nr = 0;
+		for(j=0; j<m && nr<Maxblock; j+=w){
+			if(s[j] < Runeself){
+				w = asciispan((char*)s+j, min(m-j, Maxblock-nr));
+				nr += w;
+				if(w == 0){	/* NUL */
+					w = 1;
+					if(nulls)
+						*nulls = TRUE;
+				}
+				continue;
+			}
+			if(!eof && !fullrune((char*)s+j, m-j))
+				break;
+			w = chartorune(&r, (char*)s+j);
+			nr++;
+		}
+		if(nr > 0){
+			p = addblock(b, p, TRUE, disklazyblock(disk, f, off, j, nr));
+			/* a newline byte is never part of a longer rune */
+			for(w=0; w<j; w++)
+				if(s[w] == '\n')
+					p->lines++;
+			bfixup(p);
+			b->nc += nr;
+		}
+		off += j;
+		memmove(s, s+j, m-j);
+		m -= j;
+	}
+	free(s);
+	diskfileclose(disk, f);
+	return b->nc;
+}
+
+static
+void
+loadproc(void *v)
+{
+	Loadbuf *l;
+	int nb;
+
+	USED(v);
+	threadsetname("loadproc");
+	for(;;){
+		l = recvp(cload);
+		l->nulls = FALSE;
+		cvttorunes(l->p, l->n, l->r, &nb, &l->nr, &l->nulls);
+		sendp(l->done, l);
+	}
+}
+
+/* append n runes to the buffer in whole blocks after *pp */
+static
+void
+bufappend(Buffer *b, Bnode **pp, Rune *r, uint n)
+{
+	uint m;
+
+	while(n > 0){
+		m = min(n, Maxblock);
+		*pp = addblock(b, *pp, TRUE, disknewblock(disk, m));
+		diskwrite(disk, &(*pp)->b, r, m);
+		(*pp)->lines = nlines(r, m);
+		bfixup(*pp);
+		b->nc += m;
+		r += m;
+		n -= m;
+	}
+}
+
+/*
+ * Load a big file into an empty buffer by decoding it in
+ * chunks on several loadprocs at once.  The chunks are cut
+ * at rune boundaries, so each decodes as it would have in
+ * sequence, and their runes are appended as whole blocks
+ * in file order.  Returns -1, having read nothing, if the
+ * file is not worth it.
+ */
+static
+int
+parload(Buffer *b, int fd, int *nulls)
+{
+	Dir *d;
+	Loadbuf *l, *lb;
+	Bnode *p;
+	char carry[UTFmax];
+	int i, k, m, n, nl, head, nin, ncarry, eof;
+
+	if(nloadproc == 0){
+		nloadproc = envint("loadprocs", sysconf(_SC_NPROCESSORS_ONLN));
+		if(nloadproc < 1)
+			nloadproc = 1;
+	}
+	if(nloadproc == 1)
+		return -1;
+	d = dirfstat(fd);
+	if(d == nil)
+		return -1;
+	n = (d->qid.type&QTDIR) || d->length<(vlong)envint("parload", Parload)*1024*1024;
+	free(d);
+	if(n)
+		return -1;
+	if(cload == nil){
+		cload = chancreate(sizeof(Loadbuf*), 0);
+		for(i=0; i<nloadproc; i++)
+			proccreate(loadproc, nil, STACK);
+	}
+	nl = 2*nloadproc;
+	l = emalloc(nl*sizeof(Loadbuf));
+	for(i=0; i<nl; i++){
+		l[i].p = emalloc(Loadchunk+1);
+		l[i].r = runemalloc(Loadchunk);
+		l[i].done = chancreate(sizeof(Loadbuf*), 1);
+	}
+	p = nil;
+	head = 0;
+	nin = 0;
+	ncarry = 0;
+	eof = FALSE;
+	i = 0;
+	for(;;){
+		if(!eof && nin<nl){
+			lb = &l[i];
+			memmove(lb->p, carry, ncarry);
+			m = ncarry;
+			while(!eof && m<Loadchunk){
+				n = read(fd, lb->p+m, Loadchunk-m);
+				if(n < 0)
+					warning(nil, "read error in Buffer.load");
+				if(n <= 0)
+					eof = TRUE;
+				else
+					m += n;
+			}
+			/*
+			 * Cut before the last rune, unless it is ASCII, in case
+			 * it is incomplete.  A byte that starts a rune is never
+			 * part of the one before, so the cut splits nothing.
+			 */
+			lb->n = m;
+			if(!eof)
+				for(k=m-1; k>=0 && k>=m-UTFmax; k--)
+					if((lb->p[k]&0xC0) != 0x80){
+						lb->n = (uchar)lb->p[k]<Runeself? k+1 : k;
+						break;
+					}
+			ncarry = m-lb->n;
+			memmove(carry, lb->p+lb->n, ncarry);
+			lb->p[lb->n] = 0;
+			if(lb->n > 0){
+				sendp(cload, lb);
+				nin++;
+				i = (i+1)%nl;
+			}
+			continue;
+		}
+		if(nin == 0)
+			break;
+		lb = recvp(l[head].done);
+		bufappend(b, &p, lb->r, lb->nr);
+		if(lb->nulls && nulls)
+			*nulls = TRUE;
+		head = (head+1)%nl;
+		nin--;
+	}
+	for(i=0; i<nl; i++){
+		free(l[i].p);
+		free(l[i].r);
+		chanfree(l[i].done);
+	}
+	free(l);
+	return b->nc;
+}
+
 uint
 bufload(Buffer *b, uint q0, int fd, int *nulls)
 {
+	int n;
+
 	if(q0 > b->nc)
 		error("internal error: bufload");
+	if(b->nc==0 && b->bt==nil){
+		if((n=lazyload(b, fd, nulls)) >= 0)
+			return n;
+		if((n=parload(b, fd, nulls)) >= 0)
+			return n;
+	}
 	return loadfile(fd, q0, nulls, bufloader, b);
 }
 
@@ -294,19 +747,100 @@ bufread(Buffer *b, uint q0, Rune *s, uint n)
 	}
 }
 
+/*
+ * The runes of the block holding q, which run from *q0p to *q1p.
+ * They stay put until b is next used.
+ */
+Rune*
+bufspan(Buffer *b, uint q, uint *q0p, uint *q1p)
+{
+	if(q >= b->nc)
+		error("internal error: bufspan");
+	setcache(b, q);
+	*q0p = b->cq;
+	*q1p = b->cq+b->cnc;
+	return b->c;
+}
+
+/* number of newlines before q */
+uint
+bufnl(Buffer *b, uint q)
+{
+	Bnode *p;
+	uint q0, n, nl;
+
+	if(q > b->nc)
+		error("internal error: bufnl");
+	flush(b);
+	nl = 0;
+	q0 = 0;
+	p = b->bt;
+	while(p){
+		n = bsize(p->left);
+		if(q < q0+n){
+			p = p->left;
+			continue;
+		}
+		q0 += n;
+		nl += bnl(p->left);
+		if(q < q0+p->b->u.n)
+			break;
+		q0 += p->b->u.n;
+		nl += p->lines;
+		p = p->right;
+	}
+	if(p == nil)
+		return nl;
+	/* q is inside p: count the rest there */
+	setcache(b, q0);
+	return nl+nlines(b->c, q-q0);
+}
+
+/* position just after the n'th newline; 0 if n is 0 */
+uint
+bufnlpos(Buffer *b, uint n)
+{
+	Bnode *p;
+	uint q0, i;
+
+	flush(b);
+	if(n == 0)
+		return 0;
+	if(n > bnl(b->bt))
+		error("internal error: bufnlpos");
+	q0 = 0;
+	p = b->bt;
+	for(;;){
+		if(n <= bnl(p->left)){
+			p = p->left;
+			continue;
+		}
+		n -= bnl(p->left);
+		q0 += bsize(p->left);
+		if(n <= p->lines)
+			break;
+		n -= p->lines;
+		q0 += p->b->u.n;
+		p = p->right;
+	}
+	setcache(b, q0);
+	for(i=0; ; i++)
+		if(b->c[i]=='\n' && --n==0)
+			break;
+	return q0+i+1;
+}
+
 void
 bufreset(Buffer *b)
 {
-	int i;
-
 	b->nc = 0;
 	b->cnc = 0;
 	b->cq = 0;
 	b->cdirty = 0;
-	b->cbi = 0;
-	/* delete backwards to avoid n² behavior */
-	for(i=b->nbl-1; --i>=0; )
-		delblock(b, i);
+	b->cb = nil;
+	freeblocks(b->bt);
+	b->bt = nil;
+	b->nbl = 0;
 }
 
 void
@@ -316,7 +850,4 @@ bufclose(Buffer *b)
 	free(b->c);
 	b->c = nil;
 	b->cnc = 0;
-	free(b->bl);
-	b->bl = nil;
-	b->nbl = 0;
 }
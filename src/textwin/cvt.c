@@ -0,0 +1,140 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include <cursor.h>
+#include <mouse.h>
+#include <keyboard.h>
+#include <frame.h>
+#include <fcall.h>
+#include <plumb.h>
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Conversion between UTF-8 and Runes.  Kept apart from util.c
+ * so cvtbench can be linked with it alone.
+ */
+
+/* are the 8 bytes at q all ASCII and none of them NUL? */
+static
+int
+asciiword(uchar *q)
+{
+	uvlong x;
+
+	memmove(&x, q, 8);
+	return (x&0x8080808080808080ULL)==0 && ((x-0x0101010101010101ULL)&~x&0x8080808080808080ULL)==0;
+}
+
+/*
+ * Length of the run of ASCII bytes other than NUL at the
+ * start of p, checked a word at a time where possible.
+ */
+int
+asciispan(char *p, int n)
+{
+	uchar *q;
+	int j;
+
+	q = (uchar*)p;
+	for(j=0; j+8<=n && asciiword(q+j); j+=8)
+		;
+	while(j<n && q[j]<Runeself && q[j]!=0)
+		j++;
+	return j;
+}
+
+void
+cvttorunes(char *p, int n, Rune *r, int *nb, int *nr, int *nulls)
+{
+	uchar *q;
+	Rune *s;
+	int j, w, skip, back;
+
+	/*
+	 * Always guaranteed that n bytes may be interpreted
+	 * without worrying about partial runes.  This may mean
+	 * reading up to UTFmax-1 more bytes than n; the caller
+	 * knows this.  If n is a firm limit, the caller should
+	 * set p[n] = 0.
+	 */
+	q = (uchar*)p;
+	s = r;
+	skip = 0;
+	back = 8;
+	for(j=0; j<n; j+=w){
+		/* widen runs of plain ASCII a word at a time */
+		if(j>=skip && *q<Runeself && j+8<=n){
+			if(!asciiword(q)){
+				/*
+				 * not again until past whatever stopped it,
+				 * and less often while such bytes are dense
+				 */
+				skip = j+back;
+				if(back < 256)
+					back *= 2;
+				goto Slow;
+			}
+			back = 8;
+			s[0] = q[0];
+			s[1] = q[1];
+			s[2] = q[2];
+			s[3] = q[3];
+			s[4] = q[4];
+			s[5] = q[5];
+			s[6] = q[6];
+			s[7] = q[7];
+			s += 8;
+			q += 8;
+			w = 8;
+			continue;
+		}
+	Slow:
+		if(*q < Runeself){
+			w = 1;
+			*s = *q++;
+		}else{
+			w = chartorune(s, (char*)q);
+			q += w;
+		}
+		if(*s)
+			s++;
+		else if(nulls)
+			*nulls = TRUE;
+	}
+	*nb = (char*)q-p;
+	*nr = s-r;
+}
+
+/*
+ * The reverse: encode n runes as UTF-8 in p, which must have
+ * room for n*UTFmax bytes.  Returns the number of bytes.
+ * Not NUL-terminated.
+ */
+int
+cvttobytes(Rune *r, int n, char *p)
+{
+	char *q;
+	int i;
+
+	q = p;
+	for(i=0; i<n; i++){
+		/* four ASCII runes at a time */
+		while(i+4<=n && (r[i]|r[i+1]|r[i+2]|r[i+3])<Runeself){
+			q[0] = r[i];
+			q[1] = r[i+1];
+			q[2] = r[i+2];
+			q[3] = r[i+3];
+			q += 4;
+			i += 4;
+		}
+		if(i == n)
+			break;
+		if(r[i] < Runeself)
+			*q++ = r[i];
+		else
+			q += runetochar(q, &r[i]);
+	}
+	return q-p;
+}
@@ -0,0 +1,147 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include <cursor.h>
+#include <mouse.h>
+#include <keyboard.h>
+#include <frame.h>
+#include <fcall.h>
+#include <plumb.h>
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Speed of cvttorunes and cvttobytes, in GB/s of UTF-8, on
+ * plain ASCII and on text with some runes beyond it, against
+ * the rune-at-a-time loops they replaced.  Run by mk cvtbench.
+ */
+
+enum
+{
+	Nbyte = 16*1024*1024,
+	Nrep = 8
+};
+
+static void
+slowtorunes(char *p, int n, Rune *r, int *nb, int *nr, int *nulls)
+{
+	uchar *q;
+	Rune *s;
+	int j, w;
+
+	q = (uchar*)p;
+	s = r;
+	for(j=0; j<n; j+=w){
+		if(*q < Runeself){
+			w = 1;
+			*s = *q++;
+		}else{
+			w = chartorune(s, (char*)q);
+			q += w;
+		}
+		if(*s)
+			s++;
+		else if(nulls)
+			*nulls = TRUE;
+	}
+	*nb = (char*)q-p;
+	*nr = s-r;
+}
+
+static int
+slowtobytes(Rune *r, int n, char *p)
+{
+	char *q;
+	int i;
+
+	q = p;
+	for(i=0; i<n; i++)
+		q += runetochar(q, &r[i]);
+	return q-p;
+}
+
+/* Nbyte bytes of text, every k'th rune of which is beyond ASCII, or none if k is 0 */
+static int
+mktext(char *p, int k)
+{
+	static Rune other[] = { 0xE9, 0x3B1, 0x2192, 0x4E2D };
+	int i, n;
+	Rune c;
+
+	n = 0;
+	for(i=0; n<Nbyte-UTFmax; i++){
+		if(k>0 && i%k==k-1)
+			c = other[i/k%nelem(other)];
+		else if(i%61 == 60)
+			c = '\n';
+		else
+			c = "the quick brown fox jumps over the lazy dog "[i%44];
+		n += runetochar(p+n, &c);
+	}
+	return n;
+}
+
+static void*
+alloc(ulong n)
+{
+	void *p;
+
+	p = malloc(n);
+	if(p == nil)
+		sysfatal("malloc: %r");
+	return p;
+}
+
+static double
+gbs(uvlong nbyte, vlong t)
+{
+	return (double)nbyte/t;	/* bytes per ns is GB/s */
+}
+
+static void
+bench(char *name, char *p, int n, Rune *r, char *b)
+{
+	int i, nb, nr, m;
+	vlong t0, t1, t2, t3, t4;
+
+	t0 = nsec();
+	for(i=0; i<Nrep; i++)
+		slowtorunes(p, n, r, &nb, &nr, nil);
+	t1 = nsec();
+	for(i=0; i<Nrep; i++)
+		cvttorunes(p, n, r, &nb, &nr, nil);
+	t2 = nsec();
+	for(i=0; i<Nrep; i++)
+		m = slowtobytes(r, nr, b);
+	t3 = nsec();
+	for(i=0; i<Nrep; i++)
+		m = cvttobytes(r, nr, b);
+	t4 = nsec();
+	if(m!=n || memcmp(b, p, n)!=0)
+		sysfatal("%s: text changed in conversion", name);
+	print("%-8s torunes %6.2f GB/s (was %6.2f)  tobytes %6.2f GB/s (was %6.2f)\n", name,
+		gbs((uvlong)n*Nrep, t2-t1), gbs((uvlong)n*Nrep, t1-t0),
+		gbs((uvlong)n*Nrep, t4-t3), gbs((uvlong)n*Nrep, t3-t2));
+}
+
+void
+main(int argc, char *argv[])
+{
+	char *p, *b;
+	Rune *r;
+	int n;
+
+	USED(argc);
+	USED(argv);
+	p = alloc(Nbyte+UTFmax);
+	b = alloc(Nbyte*UTFmax);
+	r = alloc(Nbyte*sizeof(Rune));
+	n = mktext(p, 0);
+	bench("ascii", p, n, r, b);
+	n = mktext(p, 50);
+	bench("1 in 50", p, n, r, b);
+	n = mktext(p, 8);
+	bench("1 in 8", p, n, r, b);
+	exits(nil);
+}
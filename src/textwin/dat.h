@@ -9,6 +9,7 @@ enum
 	Qindex,
 	Qlabel,
 	Qnew,
+	Qstats,
 
 	QWaddr,
 	QWbody,
@@ -17,6 +18,7 @@ enum
 	QWeditout,
 	QWerrors,
 	QWevent,
+	QWmatches,
 	QWrdsel,
 	QWwrsel,
 	QWtag,
@@ -26,16 +28,20 @@ enum
 
 enum
 {
-	Blockincr = 256,
-	Maxblock  = 8*1024,
+	Blockincr = 256,	/* bytes; granularity of block sizes */
+	Maxblock  = 8*1024,	/* runes */
+	Nbucket   = Maxblock*sizeof(Rune)/Blockincr+1,
 	NRange    = 10,
 	Infinity  = 0x7FFFFFFF /* huge value for regexp address */
 };
 
 #define Buffer  AcmeBuffer
 typedef	struct	Block Block;
+typedef	struct	Bnode Bnode;
 typedef	struct	Buffer Buffer;
 typedef	struct	Command Command;
+typedef	struct	Dcache Dcache;
+typedef	struct	Dfile Dfile;
 typedef	struct	Column Column;
 typedef	struct	Dirlist Dirlist;
 typedef	struct	Dirtab Dirtab;
@@ -48,6 +54,7 @@ typedef	struct	Mntdir Mntdir;
 typedef	struct	Range Range;
 typedef	struct	Rangeset Rangeset;
 typedef	struct	Reffont Reffont;
+typedef	struct	Regexp Regexp;
 typedef	struct	Row Row;
 typedef	struct	Runestr Runestr;
 typedef	struct	Text Text;
@@ -76,13 +83,66 @@ struct Block
 		uint   n;     /* number of used runes in block */
 		Block* next;  /* pointer to next in free list */
 	} u;
+	uint   nb;   /* bytes stored */
+	uchar  enc;  /* how the runes are stored */
+	uchar  freed; /* on a free list */
+	uchar  *mem; /* contents, if held in memory rather than temp file */
+	Dcache *c;   /* cached copy, if any */
+	Dfile  *f;   /* file holding the bytes of a lazily loaded block */
+	vlong  off;  /* where in it they are */
+};
+
+/* a file whose blocks are read from it only when needed */
+struct Dfile
+{
+	int    fd;
+	int    ref;      /* loader and blocks still using it */
+	int    changed;  /* seen to change underfoot */
+	uint   dev;      /* of the file, to know it by name */
+	uvlong qidpath;
+};
+
+/*
+ * Decoded copies of recently used blocks, shared by all Buffers.
+ * Writes go to the cache and reach the temp file only when the
+ * entry is evicted.
+ */
+struct Dcache
+{
+	Block   *b;      /* block held here; nil if free */
+	Rune    *r;
+	int     dirty;   /* must be written back before reuse */
+	Dcache  *prev;   /* LRU list, most recent first */
+	Dcache  *next;
 };
 
 struct Disk
 {
 	int    fd;
 	uint   addr;  /* length of temp file */
-	Block  *free[Maxblock/Blockincr+1];
+	Block  *free[Nbucket];
+	Block  *mfree[Nbucket];  /* same, for in-memory blocks */
+	uchar  *slab[Nbucket];   /* unused memory per size class */
+	int    nslab[Nbucket];
+	uint   mused;    /* bytes of memory given to blocks */
+	uint   mbudget;  /* beyond which blocks go to the temp file */
+	uchar  **map;    /* mapped pieces of temp file, or nil */
+	int    nmap;
+	Dcache *cache;   /* array of ncache entries */
+	int    ncache;
+	Dcache lru;      /* list head */
+	ulong  hits;
+	ulong  misses;
+	ulong  writebacks;
+	uvlong nrune;    /* runes in live blocks */
+	uvlong nbyte;    /* bytes they take encoded */
+	uchar  *buf;     /* staging for pread and pwrite */
+	uint   flive;    /* bytes of temp file in live blocks */
+	ulong  compactions;
+	int    lazy;     /* megabytes; larger files load lazily */
+	ulong  nlazy;    /* blocks still reading their files */
+	QLock  lk;       /* editprocs read and write at once */
+	char   *warn;    /* to give once lk is let go */
 };
 
 Disk*   diskinit(void);
@@ -90,6 +150,32 @@ Block*  disknewblock(Disk*, uint);
 void    diskrelease(Disk*, Block*);
 void    diskread(Disk*, Block*, Rune*, uint);
 void    diskwrite(Disk*, Block**, Rune*, uint);
+void    diskcompact(Disk*, int);
+Dfile*  diskfileopen(Disk*, int);
+void    diskfileclose(Disk*, Dfile*);
+Block*  disklazyblock(Disk*, Dfile*, vlong, uint, uint);
+void    disksettle(Disk*, Dir*);
+char*   diskstats(Disk*, char*, char*);
+
+/*
+ * The blocks of a Buffer are kept in file order in a treap:
+ * a binary tree ordered by position and heap-ordered by a
+ * random priority, so it stays balanced in expectation.  Each
+ * node counts the runes in its subtree, so finding the block
+ * holding a position, and adding or removing a block, is
+ * O(log nbl).
+ */
+struct Bnode
+{
+	Block  *b;
+	uint   nc;      /* runes in this subtree */
+	uint   lines;   /* newlines in this block */
+	uint   nl;      /* newlines in this subtree */
+	ulong  pri;     /* heap priority */
+	Bnode  *left;
+	Bnode  *right;
+	Bnode  *up;
+};
 
 struct Buffer
 {
@@ -99,14 +185,17 @@ struct Buffer
 	uint   cmax;    /* size of allocated cache */
 	uint   cq;      /* position of cache */
 	int    cdirty;  /* cache needs to be written */
-	uint   cbi;     /* index of cache Block */
-	Block  **bl;    /* array of blocks */
+	Bnode  *cb;     /* node of cache Block */
+	Bnode  *bt;     /* tree of blocks */
 	uint   nbl;     /* number of blocks */
 };
 void  bufinsert(Buffer*, uint, Rune*, uint);
 void  bufdelete(Buffer*, uint, uint);
 uint  bufload(Buffer*, uint, int, int*);
 void  bufread(Buffer*, uint, Rune*, uint);
+Rune* bufspan(Buffer*, uint, uint*, uint*);
+uint  bufnl(Buffer*, uint);
+uint  bufnlpos(Buffer*, uint);
 void  bufclose(Buffer*);
 void  bufreset(Buffer*);
 
@@ -141,12 +230,20 @@ struct File
 	int     editclean; /* mark clean after edit command */
 	int     seq;       /* if seq==0, File acts like Buffer */
 	int     mod;
+	uint    *undop;    /* where each change in delta begins, oldest first */
+	int     nundop;
+	int     mundop;
+	int     undomax;   /* changes kept to undo, 0 for no limit */
+	uint    undomem;   /* bytes of them kept, 0 for no limit */
+	uint    joinseq;   /* last sequence begun by a keystroke or body write */
+	uint    jointop;   /* seq of the record on top of delta, if it was one */
 	Text    *curtext;  /* most recently used associated text */
 	Text    **text;    /* list of associated texts */
 	int     ntext;
 	int    dumpid;     /* used in dumping zeroxed windows */
 };
 File*  fileaddtext(File*, Text*);
+void  filebudget(File*, int, uint);
 void  fileclose(File*);
 void  filedelete(File*, uint, uint);
 void  filedeltext(File*, Text*);
@@ -193,6 +290,7 @@ struct Text
 	int   ncachealloc;
 	Rune  *cache;
 	int	  nofill;
+	int   nodraw;       /* leave the frame alone until textrefresh */
 	int   needundo;
 };
 
@@ -214,6 +312,7 @@ void  textinsert(Text*, uint, Rune*, uint, int);
 int   textload(Text*, uint, char*, int);
 Rune  textreadc(Text*, uint);
 void  textredraw(Text*, Rectangle, Font*, Image*, int);
+void  textrefresh(Text*);
 void  textreset(Text*);
 int   textresize(Text*, Rectangle, int);
 void  textscrdraw(Text*);
@@ -247,6 +346,9 @@ struct Window
 	uchar      noscroll;
 	Range      wrselrange;
 	int        rdselfd;
+	Regexp     *matchre;    /* written to matches */
+	Range      *matches;    /* what it found, for reading at an offset */
+	int        nmatches;
 	Column     *col;
 	Xfid       *eventx;
 	char       *events;
@@ -277,6 +379,7 @@ struct Window
 void  wininit(Window*, Window*, Rectangle);
 void  winlock(Window*, int);
 void  winlock1(Window*, int);
+int   wincanlock(Window*, int);
 void  winunlock(Window*);
 void  wintype(Window*, Text*, Rune);
 void  winundo(Window*, int);
@@ -418,6 +521,8 @@ void		xfidctlwrite(Xfid*, Window*);
 void		xfideventread(Xfid*, Window*);
 void		xfideventwrite(Xfid*, Window*);
 void		xfidindexread(Xfid*);
+void		xfidstatsread(Xfid*);
+void		xfidmatchesread(Xfid*, Window*);
 void		xfidutfread(Xfid*, Text*, uint, int);
 int		xfidruneread(Xfid*, Text*, uint, uint);
 
@@ -1,4 +1,5 @@
 #include <u.h>
+#include <sys/mman.h>
 #include <libc.h>
 #include <draw.h>
 #include <thread.h>
@@ -12,6 +13,8 @@
 #include "fns.h"
 
 static	Block	*blist;
+static	Block	**bchunk;	/* every Block ever allocated, in chunks of Nchunk */
+static	int	nbchunk;
 
 int
 tempfile(void)
@@ -31,10 +34,118 @@ tempfile(void)
 	return -1;
 }
 
+enum
+{
+	Ncache = 64,		/* default number of cached blocks */
+	Mapseg = 16*1024*1024,	/* temp file is mapped in pieces this big */
+	Memory = 64,		/* default in-memory budget, megabytes */
+	Nslab = 16,		/* blocks per slab of memory */
+	Nchunk = 100,		/* Blocks per malloc */
+	Lazyload = 64		/* default size, megabytes, for lazy loading */
+};
+
+/*
+ * Block encodings.  A block is stored one byte per rune if every
+ * rune fits, else as UTF-8 if that is smaller, else as Runes.
+ * A lazily loaded block is still just bytes of its file.
+ */
+enum
+{
+	Erune,
+	Ebyte,
+	Eutf,
+	Efile
+};
+
+static
+void
+diskunmap(Disk *d)
+{
+	int i;
+
+	for(i=0; i<d->nmap; i++)
+		munmap(d->map[i], Mapseg);
+	free(d->map);
+	d->map = nil;
+	d->nmap = 0;
+}
+
+/*
+ * Give the temp file real storage from off to end, rather than
+ * the hole ftruncate leaves, so a full disk is a write error here
+ * and not a fault on a store through the mapping later.
+ */
+static
+int
+diskreserve(Disk *d, vlong off, vlong end)
+{
+	static uchar zero[64*1024];
+	int n;
+
+	for(; off<end; off+=n){
+		n = sizeof zero;
+		if(n > end-off)
+			n = end-off;
+		if(pwrite(d->fd, zero, n, off) != n)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Grow the temp file and its mapping to cover addr.  Each piece is
+ * mapped separately so earlier pieces never move.  If the file can't
+ * be mapped, fall back to pread/pwrite; the page cache keeps the two
+ * views coherent, so nothing already written is lost.
+ */
+static
+int
+diskmap(Disk *d, uint addr)
+{
+	void *v;
+
+	while(addr/Mapseg >= d->nmap){
+		if(diskreserve(d, (vlong)d->nmap*Mapseg, (vlong)(d->nmap+1)*Mapseg) < 0)
+			goto Fail;
+		v = mmap(nil, Mapseg, PROT_READ|PROT_WRITE, MAP_SHARED, d->fd, (vlong)d->nmap*Mapseg);
+		if(v == MAP_FAILED)
+			goto Fail;
+		d->map = erealloc(d->map, (d->nmap+1)*sizeof(d->map[0]));
+		d->map[d->nmap++] = v;
+	}
+	return 0;
+
+    Fail:
+	if(d->nmap > 0 && d->warn == nil)
+		d->warn = smprint("can't map temp file: %r; using read and write\n");
+	diskunmap(d);
+	return -1;
+}
+
+/*
+ * Let go of d->lk, then give any warning made while it was held:
+ * the warning text goes into a Buffer, which would take it again.
+ */
+static
+void
+diskunlock(Disk *d)
+{
+	char *w;
+
+	w = d->warn;
+	d->warn = nil;
+	qunlock(&d->lk);
+	if(w){
+		warning(nil, "%s", w);
+		free(w);
+	}
+}
+
 Disk*
 diskinit()
 {
 	Disk *d;
+	int i;
 
 	d = emalloc(sizeof(Disk));
 	d->fd = tempfile();
@@ -42,79 +153,521 @@ diskinit()
 		fprint(2, "textwin: can't create temp file: %r\n");
 		threadexitsall("diskinit");
 	}
+	if(envint("diskmap", 1))
+		diskmap(d, 0);
+	i = envint("diskmem", Memory);
+	if(i < 0)
+		i = 0;
+	if(i > 4095)	/* addresses are uint */
+		i = 4095;
+	d->mbudget = (uint)i*1024*1024;
+	d->lazy = envint("lazyload", Lazyload);
+	d->ncache = envint("diskcache", Ncache);
+	if(d->ncache < 0)
+		d->ncache = 0;
+	d->lru.next = &d->lru;
+	d->lru.prev = &d->lru;
+	if(d->ncache > 0)
+		d->cache = emalloc(d->ncache*sizeof(Dcache));
+	for(i=0; i<d->ncache; i++){
+		d->cache[i].next = d->lru.next;
+		d->cache[i].prev = &d->lru;
+		d->lru.next->prev = &d->cache[i];
+		d->lru.next = &d->cache[i];
+	}
 	return d;
 }
 
+/* size class of a block storing nb bytes */
 static
 uint
-ntosize(uint n, uint *ip)
+ntosize(uint nb, uint *ip)
 {
 	uint size;
 
-	if(n > Maxblock)
+	if(nb > Maxblock*sizeof(Rune))
 		error("internal error: ntosize");
-	size = n;
+	size = nb;
 	if(size & (Blockincr-1))
 		size += Blockincr - (size & (Blockincr-1));
-	/* last bucket holds blocks of exactly Maxblock */
+	/* last bucket holds blocks of exactly Maxblock runes */
 	if(ip)
 		*ip = size/Blockincr;
-	return size * sizeof(Rune);
+	return size;
+}
+
+/*
+ * Choose the encoding for n runes; returns the bytes it takes.
+ * Surrogates and runes beyond Runemax don't survive UTF-8,
+ * so blocks holding them are kept as Runes.
+ */
+static
+uint
+blockenc(Rune *r, uint n, uchar *encp)
+{
+	uint i, nb;
+	Rune c, max;
+
+	max = 0;
+	nb = 0;
+	for(i=0; i<n; i++){
+		c = r[i];
+		if(c < 0x80){
+			nb++;
+			continue;
+		}
+		if(c > max)
+			max = c;
+		if(c < 0x800)
+			nb += 2;
+		else if(c>=0xD800 && c<0xE000)
+			max = Runemax+1;
+		else if(c < 0x10000)
+			nb += 3;
+		else
+			nb += 4;
+	}
+	if(max < 0x100){
+		*encp = Ebyte;
+		return n;
+	}
+	if(max<=Runemax && nb<n*sizeof(Rune)){
+		*encp = Eutf;
+		return nb;
+	}
+	*encp = Erune;
+	return n*sizeof(Rune);
+}
+
+static
+void
+encode(int enc, Rune *r, uint n, uchar *p)
+{
+	uint i;
+
+	switch(enc){
+	case Ebyte:
+		for(i=0; i<n; i++)
+			p[i] = r[i];
+		break;
+	case Eutf:
+		for(i=0; i<n; i++)
+			if(r[i] < 0x80)
+				*p++ = r[i];
+			else
+				p += runetochar((char*)p, &r[i]);
+		break;
+	default:
+		memmove(p, r, n*sizeof(Rune));
+	}
+}
+
+static
+void
+decode(int enc, uchar *p, Rune *r, uint n)
+{
+	uint i;
+
+	switch(enc){
+	case Ebyte:
+		for(i=0; i<n; i++)
+			r[i] = p[i];
+		break;
+	case Eutf:
+		for(i=0; i<n; i++)
+			if(*p < 0x80)
+				r[i] = *p++;
+			else
+				p += chartorune(&r[i], (char*)p);
+		break;
+	default:
+		memmove(r, p, n*sizeof(Rune));
+	}
+}
+
+static
+void
+cacheunlink(Dcache *c)
+{
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+}
+
+/* move c to the head (most recent) or tail (next to be reused) of the LRU list */
+static
+void
+cachemove(Disk *d, Dcache *c, int head)
+{
+	cacheunlink(c);
+	if(head){
+		c->prev = &d->lru;
+		c->next = d->lru.next;
+	}else{
+		c->prev = d->lru.prev;
+		c->next = &d->lru;
+	}
+	c->prev->next = c;
+	c->next->prev = c;
+}
+
+/* where b's bytes can be reached directly, or nil if only by pread */
+static
+uchar*
+blockbytes(Disk *d, Block *b)
+{
+	if(b->enc == Efile)
+		return nil;
+	if(b->mem)
+		return b->mem;
+	if(d->map)
+		return d->map[b->addr/Mapseg] + b->addr%Mapseg;
+	return nil;
+}
+
+static
+uchar*
+diskbuf(Disk *d)
+{
+	if(d->buf == nil)
+		d->buf = emalloc(Maxblock*sizeof(Rune)+UTFmax+1);
+	return d->buf;
+}
+
+/*
+ * Decode the bytes of a lazily loaded block as cvttorunes would
+ * have, NULs and all.  p[nb] must be 0.  Returns the runes made,
+ * which is fewer than n only if the file has changed.
+ */
+static
+uint
+filedecode(uchar *p, uint nb, Rune *r, uint n)
+{
+	uint i, j;
+	Rune c;
+
+	i = 0;
+	for(j=0; i<n && j<nb; ){
+		if(p[j] < Runeself)
+			c = p[j++];
+		else
+			j += chartorune(&c, (char*)p+j);
+		if(c)
+			r[i++] = c;
+	}
+	return i;
 }
 
+static
+void
+fileread(Disk *d, Block *b, Rune *r, uint n)
+{
+	uchar *p;
+	int m;
+	uint i;
+
+	p = diskbuf(d);
+	m = pread(b->f->fd, p, b->nb, b->off);
+	if(m < 0)
+		m = 0;
+	p[m] = 0;
+	i = filedecode(p, m, r, n);
+	if(i < n){
+		if(!b->f->changed && d->warn==nil)
+			d->warn = estrdup("lazily loaded file changed on disk; Get it again\n");
+		b->f->changed = TRUE;
+		while(i < n)
+			r[i++] = Runeerror;
+	}
+}
+
+static
+void
+blockread(Disk *d, Block *b, Rune *r, uint n)
+{
+	uchar *p;
+
+	if(b->enc == Efile){
+		fileread(d, b, r, n);
+		return;
+	}
+	p = blockbytes(d, b);
+	if(p == nil){
+		if(b->enc == Erune){
+			if(pread(d->fd, r, n*sizeof(Rune), b->addr) != n*sizeof(Rune))
+				error("read error from temp file");
+			return;
+		}
+		p = diskbuf(d);
+		if(pread(d->fd, p, b->nb, b->addr) != b->nb)
+			error("read error from temp file");
+	}
+	decode(b->enc, p, r, n);
+}
+
+static
+void
+blockwrite(Disk *d, Block *b, Rune *r, uint n)
+{
+	uchar *p;
+
+	p = blockbytes(d, b);
+	if(p != nil){
+		encode(b->enc, r, n, p);
+		return;
+	}
+	if(b->enc == Erune)
+		p = (uchar*)r;
+	else{
+		p = diskbuf(d);
+		encode(b->enc, r, n, p);
+	}
+	if(pwrite(d->fd, p, b->nb, b->addr) != b->nb)
+		error("write error to temp file");
+}
+
+/* Runes reachable without the temp file are copied, not cached */
+static
+int
+direct(Disk *d, Block *b)
+{
+	return b->enc==Erune && blockbytes(d, b)!=nil;
+}
+
+static
+void
+writeback(Disk *d, Dcache *c)
+{
+	blockwrite(d, c->b, c->r, c->b->u.n);
+	c->dirty = FALSE;
+	d->writebacks++;
+}
+
+/* drop b from the cache without writing it */
+static
+void
+cachedrop(Disk *d, Block *b)
+{
+	Dcache *c;
+
+	c = b->c;
+	if(c == nil)
+		return;
+	c->b = nil;
+	c->dirty = FALSE;
+	b->c = nil;
+	cachemove(d, c, FALSE);
+}
+
+/*
+ * Put a copy of r in the cache as the contents of b,
+ * evicting the least recently used entry if b is not
+ * already there.  Returns nil if there is no cache.
+ */
+static
+Dcache*
+cacheput(Disk *d, Block *b, Rune *r, uint n)
+{
+	Dcache *c;
+
+	if(d->ncache==0 || direct(d, b)){
+		cachedrop(d, b);
+		return nil;
+	}
+	c = b->c;
+	if(c == nil){
+		c = d->lru.prev;
+		if(c->b){
+			if(c->dirty)
+				writeback(d, c);
+			c->b->c = nil;
+		}
+		if(c->r == nil)
+			c->r = runemalloc(Maxblock);
+		c->b = b;
+		c->dirty = FALSE;
+		b->c = c;
+	}
+	runemove(c->r, r, n);
+	cachemove(d, c, TRUE);
+	return c;
+}
+
+static
 Block*
-disknewblock(Disk *d, uint n)
+blockalloc(void)
 {
-	uint i, j, size;
 	Block *b;
+	int j;
 
-	size = ntosize(n, &i);
-	b = d->free[i];
-	if(b)
-		d->free[i] = b->u.next;
-	else{
-		/* allocate in chunks to reduce malloc overhead */
-		if(blist == nil){
-			blist = emalloc(100*sizeof(Block));
-			for(j=0; j<100-1; j++)
+	/* allocate in chunks to reduce malloc overhead */
+	if(blist == nil){
+		blist = emalloc(Nchunk*sizeof(Block));
+		for(j=0; j<Nchunk; j++){
+			blist[j].freed = TRUE;
+			if(j < Nchunk-1)
 				blist[j].u.next = &blist[j+1];
 		}
-		b = blist;
-		blist = b->u.next;
-		b->addr = d->addr;
-		d->addr += size;
+		bchunk = erealloc(bchunk, (nbchunk+1)*sizeof(bchunk[0]));
+		bchunk[nbchunk++] = blist;
+	}
+	b = blist;
+	blist = b->u.next;
+	return b;
+}
+
+/* place size bytes at the end of the temp file */
+static
+uint
+fileaddr(Disk *d, uint size)
+{
+	uint addr;
+
+	/* blocks don't straddle pieces of the mapping */
+	if(d->map && d->addr/Mapseg!=(d->addr+size-1)/Mapseg)
+		d->addr += Mapseg - d->addr%Mapseg;
+	addr = d->addr;
+	d->addr += size;
+	return addr;
+}
+
+/*
+ * Memory for an in-memory block of size class i, carved from
+ * a slab of Nslab such blocks.  It is never freed; released
+ * blocks keep their memory on d->mfree[i].
+ */
+static
+uchar*
+slaballoc(Disk *d, uint i, uint size)
+{
+	uchar *r;
+
+	if(d->nslab[i] == 0){
+		d->slab[i] = emalloc(Nslab*size);
+		d->nslab[i] = Nslab;
 	}
+	r = d->slab[i];
+	d->slab[i] = r+size;
+	d->nslab[i]--;
+	d->mused += size;
+	return r;
+}
+
+/* a block with room for nb bytes */
+static
+Block*
+blocknew(Disk *d, uint nb)
+{
+	uint i, size;
+	Block *b;
+
+	size = ntosize(nb, &i);
+	if(b = d->mfree[i])	/* assign = */
+		d->mfree[i] = b->u.next;
+	else if(d->mused+size <= d->mbudget){
+		b = blockalloc();
+		b->mem = slaballoc(d, i, size);
+	}else if(b = d->free[i]){	/* assign = */
+		d->free[i] = b->u.next;
+		d->flive += size;
+	}else{
+		/* over the memory budget: spill to the temp file */
+		b = blockalloc();
+		b->mem = nil;
+		b->addr = fileaddr(d, size);
+		if(d->map)
+			diskmap(d, d->addr-1);
+		d->flive += size;
+	}
+	b->freed = FALSE;
+	b->nb = nb;
+	b->c = nil;
+	return b;
+}
+
+Block*
+disknewblock(Disk *d, uint n)
+{
+	Block *b;
+
+	/* guess one byte per rune; diskwrite resizes it if not */
+	qlock(&d->lk);
+	b = blocknew(d, n);
+	b->enc = Ebyte;
 	b->u.n = n;
+	d->nrune += n;
+	d->nbyte += n;
+	diskunlock(d);
 	return b;
 }
 
+static
 void
-diskrelease(Disk *d, Block *b)
+blockrelease(Disk *d, Block *b)
 {
 	uint i;
 
-	ntosize(b->u.n, &i);
-	b->u.next = d->free[i];
-	d->free[i] = b;
+	cachedrop(d, b);
+	b->freed = TRUE;
+	if(b->enc == Efile){
+		/* the Block itself goes back; it has no storage to keep */
+		diskfileclose(d, b->f);
+		b->f = nil;
+		d->nlazy--;
+		b->u.next = blist;
+		blist = b;
+		return;
+	}
+	d->nrune -= b->u.n;
+	d->nbyte -= b->nb;
+	if(b->mem){
+		ntosize(b->nb, &i);
+		b->u.next = d->mfree[i];
+		d->mfree[i] = b;
+	}else{
+		d->flive -= ntosize(b->nb, &i);
+		b->u.next = d->free[i];
+		d->free[i] = b;
+	}
+}
+
+void
+diskrelease(Disk *d, Block *b)
+{
+	qlock(&d->lk);
+	blockrelease(d, b);
+	diskunlock(d);
 }
 
 void
 diskwrite(Disk *d, Block **bp, Rune *r, uint n)
 {
-	int size, nsize;
+	uint nb;
+	uchar enc;
 	Block *b;
+	Dcache *c;
 
+	qlock(&d->lk);
 	b = *bp;
-	size = ntosize(b->u.n, nil);
-	nsize = ntosize(n, nil);
-	if(size != nsize){
-		diskrelease(d, b);
-		b = disknewblock(d, n);
+	nb = blockenc(r, n, &enc);
+	if(b->enc==Efile || ntosize(nb, nil)!=ntosize(b->nb, nil)){
+		blockrelease(d, b);
+		b = blocknew(d, nb);
 		*bp = b;
+	}else{
+		d->nrune -= b->u.n;
+		d->nbyte -= b->nb;
 	}
-	if(pwrite(d->fd, r, n*sizeof(Rune), b->addr) != n*sizeof(Rune))
-		error("write error to temp file");
 	b->u.n = n;
+	b->nb = nb;
+	b->enc = enc;
+	d->nrune += n;
+	d->nbyte += nb;
+	c = cacheput(d, b, r, n);
+	if(c != nil)
+		c->dirty = TRUE;
+	else
+		blockwrite(d, b, r, n);
+	diskunlock(d);
 }
 
 void
@@ -123,7 +676,224 @@ diskread(Disk *d, Block *b, Rune *r, uint n)
 	if(n > b->u.n)
 		error("internal error: diskread");
 
-	ntosize(b->u.n, nil);
-	if(pread(d->fd, r, n*sizeof(Rune), b->addr) != n*sizeof(Rune))
-		error("read error from temp file");
+	qlock(&d->lk);
+	if(b->c){
+		d->hits++;
+		runemove(r, b->c->r, n);
+		cachemove(d, b->c, TRUE);
+	}else if(direct(d, b))
+		blockread(d, b, r, n);
+	else{
+		d->misses++;
+		blockread(d, b, r, n);
+		if(n == b->u.n)
+			cacheput(d, b, r, n);
+	}
+	diskunlock(d);
+}
+
+static
+int
+addrcmp(const void *a, const void *b)
+{
+	uint x, y;
+
+	x = (*(Block**)a)->addr;
+	y = (*(Block**)b)->addr;
+	return x<y? -1 : x>y;
+}
+
+/*
+ * Slide the live blocks of the temp file down over the dead
+ * space between them and give the tail back to the system.
+ * Unless forced, only worth it when most of the file is dead.
+ * Block addresses change but the Blocks themselves don't move,
+ * so the Buffers holding them need not know.
+ */
+void
+diskcompact(Disk *d, int force)
+{
+	uint i, j, n, size, addr, dead;
+	Block **live, *b;
+	uchar *p;
+
+	qlock(&d->lk);
+	dead = d->addr - d->flive;
+	if(dead==0 || (!force && (dead<Mapseg || dead<d->flive))){
+		diskunlock(d);
+		return;
+	}
+	n = 0;
+	live = emalloc(nbchunk*Nchunk*sizeof(live[0]));
+	for(i=0; i<nbchunk; i++)
+		for(j=0; j<Nchunk; j++){
+			b = &bchunk[i][j];
+			if(!b->freed && b->mem==nil && b->enc!=Efile)
+				live[n++] = b;
+		}
+	qsort(live, n, sizeof(live[0]), addrcmp);
+	d->addr = 0;
+	for(i=0; i<n; i++){
+		b = live[i];
+		size = ntosize(b->nb, nil);
+		addr = fileaddr(d, size);
+		if(addr==b->addr || (b->c && b->c->dirty)){
+			b->addr = addr;
+			continue;
+		}
+		if(d->map)
+			memmove(d->map[addr/Mapseg]+addr%Mapseg, blockbytes(d, b), b->nb);
+		else{
+			/* short if the block's Buffer has yet to write it */
+			p = diskbuf(d);
+			if(pread(d->fd, p, b->nb, b->addr) < 0)
+				error("read error from temp file");
+			if(pwrite(d->fd, p, b->nb, addr) != b->nb)
+				error("write error to temp file");
+		}
+		b->addr = addr;
+	}
+	free(live);
+
+	/* the dead blocks are all gone now */
+	for(i=0; i<Nbucket; i++)
+		while(b = d->free[i]){	/* assign = */
+			d->free[i] = b->u.next;
+			b->u.next = blist;
+			blist = b;
+		}
+	while(d->nmap>1 && (d->nmap-1)*Mapseg>=d->addr)
+		munmap(d->map[--d->nmap], Mapseg);
+	ftruncate(d->fd, d->addr);
+	/* the mapped pieces left must still be backed by the file */
+	if(d->map && diskreserve(d, d->addr, (vlong)d->nmap*Mapseg) < 0){
+		if(d->warn == nil)
+			d->warn = smprint("can't map temp file: %r; using read and write\n");
+		diskunmap(d);
+		ftruncate(d->fd, d->addr);
+	}
+	d->compactions++;
+	diskunlock(d);
+}
+
+Dfile*
+diskfileopen(Disk *d, int fd)
+{
+	Dfile *f;
+	Dir *dir;
+
+	USED(d);
+	dir = dirfstat(fd);
+	if(dir == nil)
+		return nil;
+	fd = dup(fd, -1);
+	if(fd < 0){
+		free(dir);
+		return nil;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	f = emalloc(sizeof(Dfile));
+	f->fd = fd;
+	f->ref = 1;
+	f->dev = dir->dev;
+	f->qidpath = dir->qid.path;
+	free(dir);
+	return f;
+}
+
+void
+diskfileclose(Disk *d, Dfile *f)
+{
+	USED(d);
+	if(--f->ref > 0)
+		return;
+	close(f->fd);
+	free(f);
+}
+
+/* a block of n runes that are, for now, the nb bytes at off in f */
+Block*
+disklazyblock(Disk *d, Dfile *f, vlong off, uint nb, uint n)
+{
+	Block *b;
+
+	qlock(&d->lk);
+	b = blockalloc();
+	b->freed = FALSE;
+	b->enc = Efile;
+	b->mem = nil;
+	b->c = nil;
+	b->f = f;
+	b->off = off;
+	b->nb = nb;
+	b->u.n = n;
+	f->ref++;
+	d->nlazy++;
+	diskunlock(d);
+	return b;
+}
+
+/*
+ * Copy the lazily loaded blocks of the file dir describes into
+ * storage of their own, so it can be rewritten.  Blocks of other
+ * files stay lazy.
+ */
+void
+disksettle(Disk *d, Dir *dir)
+{
+	uint i, j, nb;
+	uchar enc;
+	Block *b, *t;
+	Rune *r;
+
+	qlock(&d->lk);
+	if(d->nlazy == 0){
+		diskunlock(d);
+		return;
+	}
+	r = runemalloc(Maxblock);
+	for(i=0; i<nbchunk; i++)
+		for(j=0; j<Nchunk; j++){
+			b = &bchunk[i][j];
+			if(b->freed || b->enc!=Efile)
+				continue;
+			if(b->f->dev!=dir->dev || b->f->qidpath!=dir->qid.path)
+				continue;
+			if(b->c)
+				runemove(r, b->c->r, b->u.n);
+			else
+				fileread(d, b, r, b->u.n);
+			nb = blockenc(r, b->u.n, &enc);
+			/* take t's storage and give back the Block */
+			t = blocknew(d, nb);
+			diskfileclose(d, b->f);
+			b->f = nil;
+			b->mem = t->mem;
+			b->addr = t->addr;
+			b->nb = nb;
+			b->enc = enc;
+			t->freed = TRUE;
+			t->u.next = blist;
+			blist = t;
+			d->nlazy--;
+			d->nrune += b->u.n;
+			d->nbyte += nb;
+			if(direct(d, b))
+				cachedrop(d, b);
+			blockwrite(d, b, r, b->u.n);
+		}
+	free(r);
+	diskunlock(d);
+}
+
+char*
+diskstats(Disk *d, char *p, char *e)
+{
+	p = seprint(p, e, "disk %s size %ud\n", d->map? "mmap" : "pread", d->addr);
+	p = seprint(p, e, "disk runes %llud bytes %llud lazy blocks %lud\n", d->nrune, d->nbyte, d->nlazy);
+	p = seprint(p, e, "disk file live %ud dead %ud compactions %lud\n",
+		d->flive, d->addr-d->flive, d->compactions);
+	p = seprint(p, e, "disk memory %ud budget %ud\n", d->mused, d->mbudget);
+	return seprint(p, e, "disk cache %d hits %lud misses %lud writebacks %lud\n",
+		d->ncache, d->hits, d->misses, d->writebacks);
 }
@@ -13,12 +13,9 @@
 #include "fns.h"
 
 int	Glooping;
-int	nest;
 char	Enoname[] = "no file name given";
 
-Address	addr;
 File	*menu;
-Rangeset	sel;
 extern	Text*	curtext;
 Rune	*collection;
 int	ncollection;
@@ -31,6 +28,8 @@ void	filelooper(Cmd*, int);
 void	linelooper(File*, Cmd*);
 Address	lineaddr(long, Address, int);
 int	filematch(File*, String*);
+static	int	filelocal(Cmd*);
+static	void	parlooper(Cmd*, Window**, int);
 File	*tofile(String*);
 Rune*	cmdname(File *f, String *s, int);
 void	runpipe(Text*, int, Rune*, int, int);
@@ -46,7 +45,7 @@ clearcollection(void)
 void
 resetxec(void)
 {
-	Glooping = nest = 0;
+	Glooping = edstate()->nest = 0;
 	clearcollection();
 }
 
@@ -58,15 +57,55 @@ mkaddr(Address *a, File *f)
 	a->f = f;
 }
 
+/*
+ * The Edstate of the thread running commands.  The editthread
+ * has no thread data and uses the one here; each editproc
+ * points its own at one on its stack.
+ */
+static Edstate	edstate0;
+
+Edstate*
+edstate(void)
+{
+	Edstate *e;
+
+	e = *threaddata();
+	if(e == nil)
+		return &edstate0;
+	return e;
+}
+
+/* give cp the address its command takes when it is given none */
+static void
+defaddr(Cmd *cp, int def)
+{
+	Addr *ap;
+
+	if(cp->cmdc == '\n')
+		return;
+	if((ap=cp->addr) == 0){
+		cp->addr = ap = newaddr();
+		ap->type = '.';
+		if(def == aAll)
+			ap->type = '*';
+	}else if(ap->type=='"' && ap->next==0){
+		ap->next = newaddr();
+		ap->next->type = '.';
+		if(def == aAll)
+			ap->next->type = '*';
+	}
+}
+
 int
 cmdexec(Text *t, Cmd *cp)
 {
 	int i;
-	Addr *ap;
 	File *f;
 	Window *w;
 	Address dot;
+	Edstate *ed;
 
+	ed = edstate();
 	if(t == nil)
 		w = nil;
 	else
@@ -83,25 +122,15 @@ cmdexec(Text *t, Cmd *cp)
 		f->curtext = t;
 	}
 	if(i>=0 && cmdtab[i].defaddr != aNo){
-		if((ap=cp->addr)==0 && cp->cmdc!='\n'){
-			cp->addr = ap = newaddr();
-			ap->type = '.';
-			if(cmdtab[i].defaddr == aAll)
-				ap->type = '*';
-		}else if(ap && ap->type=='"' && ap->next==0 && cp->cmdc!='\n'){
-			ap->next = newaddr();
-			ap->next->type = '.';
-			if(cmdtab[i].defaddr == aAll)
-				ap->next->type = '*';
-		}
+		defaddr(cp, cmdtab[i].defaddr);
 		if(cp->addr){	/* may be false for '\n' (only) */
 			static Address none = {0,0,nil};
 			if(f){
 				mkaddr(&dot, f);
-				addr = cmdaddress(ap, dot, 0);
+				ed->addr = cmdaddress(cp->addr, dot, 0);
 			}else	/* a " */
-				addr = cmdaddress(ap, none, 0);
-			f = addr.f;
+				ed->addr = cmdaddress(cp->addr, none, 0);
+			f = ed->addr.f;
 			t = f->curtext;
 		}
 	}
@@ -168,7 +197,7 @@ filelist(Text *t, Rune *r, int nr)
 int
 a_cmd(Text *t, Cmd *cp)
 {
-	return append(t->file, cp, addr.r.q1);
+	return append(t->file, cp, edstate()->addr.r.q1);
 }
 
 int
@@ -178,7 +207,7 @@ b_cmd(Text *t, Cmd *cp)
 
 	USED(t);
 	f = tofile(cp->u.text);
-	if(nest == 0)
+	if(edstate()->nest == 0)
 		pfilename(f);
 	curtext = f->curtext;
 	return TRUE;
@@ -212,20 +241,26 @@ B_cmd(Text *t, Cmd *cp)
 int
 c_cmd(Text *t, Cmd *cp)
 {
-	elogreplace(t->file, addr.r.q0, addr.r.q1, cp->u.text->r, cp->u.text->n);
-	t->q0 = addr.r.q0;
-	t->q1 = addr.r.q1;
+	Edstate *ed;
+
+	ed = edstate();
+	elogreplace(t->file, ed->addr.r.q0, ed->addr.r.q1, cp->u.text->r, cp->u.text->n);
+	t->q0 = ed->addr.r.q0;
+	t->q1 = ed->addr.r.q1;
 	return TRUE;
 }
 
 int
 d_cmd(Text *t, Cmd *cp)
 {
+	Edstate *ed;
+
 	USED(cp);
-	if(addr.r.q1 > addr.r.q0)
-		elogdelete(t->file, addr.r.q0, addr.r.q1);
-	t->q0 = addr.r.q0;
-	t->q1 = addr.r.q0;
+	ed = edstate();
+	if(ed->addr.r.q1 > ed->addr.r.q0)
+		elogdelete(t->file, ed->addr.r.q0, ed->addr.r.q1);
+	t->q0 = ed->addr.r.q0;
+	t->q1 = ed->addr.r.q0;
 	return TRUE;
 }
 
@@ -301,10 +336,12 @@ e_cmd(Text *t, Cmd *cp)
 	int i, isdir, q0, q1, fd, nulls, samename, allreplaced;
 	char *s, tmp[128];
 	Dir *d;
+	Edstate *ed;
 
+	ed = edstate();
 	f = t->file;
-	q0 = addr.r.q0;
-	q1 = addr.r.q1;
+	q0 = ed->addr.r.q0;
+	q1 = ed->addr.r.q1;
 	if(cp->cmdc == 'e'){
 		if(winclean(t->w, TRUE)==FALSE)
 			editerror("");	/* winclean generated message already */
@@ -369,15 +406,19 @@ f_cmd(Text *t, Cmd *cp)
 int
 g_cmd(Text *t, Cmd *cp)
 {
-	if(t->file != addr.f){
+	Regexp *re;
+	Edstate *ed;
+
+	ed = edstate();
+	if(t->file != ed->addr.f){
 		warning(nil, "internal error: g_cmd f!=addr.f\n");
 		return FALSE;
 	}
-	if(rxcompile(cp->re->r) == FALSE)
+	if((re = editregexp(cp->re)) == nil)
 		editerror("bad regexp in g command");
-	if(rxexecute(t, nil, addr.r.q0, addr.r.q1, &sel) ^ cp->cmdc=='v'){
-		t->q0 = addr.r.q0;
-		t->q1 = addr.r.q1;
+	if(rxexecute(re, t, nil, ed->addr.r.q0, ed->addr.r.q1, &ed->sel) ^ cp->cmdc=='v'){
+		t->q0 = ed->addr.r.q0;
+		t->q1 = ed->addr.r.q1;
 		return cmdexec(t, cp->u.cmd);
 	}
 	return TRUE;
@@ -386,7 +427,7 @@ g_cmd(Text *t, Cmd *cp)
 int
 i_cmd(Text *t, Cmd *cp)
 {
-	return append(t->file, cp, addr.r.q0);
+	return append(t->file, cp, edstate()->addr.r.q0);
 }
 
 void
@@ -395,10 +436,12 @@ copy(File *f, Address addr2)
 	long p;
 	int ni;
 	Rune *buf;
+	Edstate *ed;
 
+	ed = edstate();
 	buf = fbufalloc();
-	for(p=addr.r.q0; p<addr.r.q1; p+=ni){
-		ni = addr.r.q1-p;
+	for(p=ed->addr.r.q0; p<ed->addr.r.q1; p+=ni){
+		ni = ed->addr.r.q1-p;
 		if(ni > RBUFSIZE)
 			ni = RBUFSIZE;
 		bufread(&f->b, p, buf, ni);
@@ -410,13 +453,16 @@ copy(File *f, Address addr2)
 void
 move(File *f, Address addr2)
 {
-	if(addr.f!=addr2.f || addr.r.q1<=addr2.r.q0){
-		elogdelete(f, addr.r.q0, addr.r.q1);
+	Edstate *ed;
+
+	ed = edstate();
+	if(ed->addr.f!=addr2.f || ed->addr.r.q1<=addr2.r.q0){
+		elogdelete(f, ed->addr.r.q0, ed->addr.r.q1);
 		copy(f, addr2);
-	}else if(addr.r.q0 >= addr2.r.q1){
+	}else if(ed->addr.r.q0 >= addr2.r.q1){
 		copy(f, addr2);
-		elogdelete(f, addr.r.q0, addr.r.q1);
-	}else if(addr.r.q0==addr2.r.q0 && addr.r.q1==addr2.r.q1){
+		elogdelete(f, ed->addr.r.q0, ed->addr.r.q1);
+	}else if(ed->addr.r.q0==addr2.r.q0 && ed->addr.r.q1==addr2.r.q1){
 		; /* move to self; no-op */
 	}else
 		editerror("move overlaps itself");
@@ -452,64 +498,67 @@ s_cmd(Text *t, Cmd *cp)
 	Rangeset *rp;
 	char *err;
 	Rune *rbuf;
+	Regexp *re;
+	Edstate *ed;
 
+	ed = edstate();
 	n = cp->num;
 	op= -1;
-	if(rxcompile(cp->re->r) == FALSE)
+	if((re = editregexp(cp->re)) == nil)
 		editerror("bad regexp in s command");
 	nrp = 0;
 	rp = nil;
 	delta = 0;
 	didsub = FALSE;
-	for(p1 = addr.r.q0; p1<=addr.r.q1 && rxexecute(t, nil, p1, addr.r.q1, &sel); ){
-		if(sel.r[0].q0 == sel.r[0].q1){	/* empty match? */
-			if(sel.r[0].q0 == op){
+	for(p1 = ed->addr.r.q0; p1<=ed->addr.r.q1 && rxexecute(re, t, nil, p1, ed->addr.r.q1, &ed->sel); ){
+		if(ed->sel.r[0].q0 == ed->sel.r[0].q1){	/* empty match? */
+			if(ed->sel.r[0].q0 == op){
 				p1++;
 				continue;
 			}
-			p1 = sel.r[0].q1+1;
+			p1 = ed->sel.r[0].q1+1;
 		}else
-			p1 = sel.r[0].q1;
-		op = sel.r[0].q1;
+			p1 = ed->sel.r[0].q1;
+		op = ed->sel.r[0].q1;
 		if(--n>0)
 			continue;
 		nrp++;
 		rp = erealloc(rp, nrp*sizeof(Rangeset));
-		rp[nrp-1] = sel;
+		rp[nrp-1] = ed->sel;
 	}
 	rbuf = fbufalloc();
 	buf = allocstring(0);
 	for(m=0; m<nrp; m++){
 		buf->n = 0;
 		buf->r[0] = '\0';
-		sel = rp[m];
+		ed->sel = rp[m];
 		for(i = 0; i<cp->u.text->n; i++)
 			if((c = cp->u.text->r[i])=='\\' && i<cp->u.text->n-1){
 				c = cp->u.text->r[++i];
 				if('1'<=c && c<='9') {
 					j = c-'0';
-					if(sel.r[j].q1-sel.r[j].q0>RBUFSIZE){
+					if(ed->sel.r[j].q1-ed->sel.r[j].q0>RBUFSIZE){
 						err = "replacement string too long";
 						goto Err;
 					}
-					bufread(&t->file->b, sel.r[j].q0, rbuf, sel.r[j].q1-sel.r[j].q0);
-					for(k=0; k<sel.r[j].q1-sel.r[j].q0; k++)
+					bufread(&t->file->b, ed->sel.r[j].q0, rbuf, ed->sel.r[j].q1-ed->sel.r[j].q0);
+					for(k=0; k<ed->sel.r[j].q1-ed->sel.r[j].q0; k++)
 						Straddc(buf, rbuf[k]);
 				}else
 				 	Straddc(buf, c);
 			}else if(c!='&')
 				Straddc(buf, c);
 			else{
-				if(sel.r[0].q1-sel.r[0].q0>RBUFSIZE){
+				if(ed->sel.r[0].q1-ed->sel.r[0].q0>RBUFSIZE){
 					err = "right hand side too long in substitution";
 					goto Err;
 				}
-				bufread(&t->file->b, sel.r[0].q0, rbuf, sel.r[0].q1-sel.r[0].q0);
-				for(k=0; k<sel.r[0].q1-sel.r[0].q0; k++)
+				bufread(&t->file->b, ed->sel.r[0].q0, rbuf, ed->sel.r[0].q1-ed->sel.r[0].q0);
+				for(k=0; k<ed->sel.r[0].q1-ed->sel.r[0].q0; k++)
 					Straddc(buf, rbuf[k]);
 			}
-		elogreplace(t->file, sel.r[0].q0, sel.r[0].q1,  buf->r, buf->n);
-		delta -= sel.r[0].q1-sel.r[0].q0;
+		elogreplace(t->file, ed->sel.r[0].q0, ed->sel.r[0].q1,  buf->r, buf->n);
+		delta -= ed->sel.r[0].q1-ed->sel.r[0].q0;
 		delta += buf->n;
 		didsub = 1;
 		if(!cp->flag)
@@ -518,10 +567,10 @@ s_cmd(Text *t, Cmd *cp)
 	free(rp);
 	freestring(buf);
 	fbuffree(rbuf);
-	if(!didsub && nest==0)
+	if(!didsub && ed->nest==0)
 		editerror("no substitution");
-	t->q0 = addr.r.q0;
-	t->q1 = addr.r.q1;
+	t->q0 = ed->addr.r.q0;
+	t->q1 = ed->addr.r.q1;
 	return TRUE;
 
 Err:
@@ -556,14 +605,16 @@ w_cmd(Text *t, Cmd *cp)
 {
 	Rune *r;
 	File *f;
+	Edstate *ed;
 
+	ed = edstate();
 	f = t->file;
 	if(f->seq == seq)
 		editerror("can't write file with pending modifications");
 	r = cmdname(f, cp->u.text, FALSE);
 	if(r == nil)
 		editerror("no name specified for 'w' command");
-	putfile(f, addr.r.q0, addr.r.q1, r, runestrlen(r));
+	putfile(f, ed->addr.r.q0, ed->addr.r.q1, r, runestrlen(r));
 	/* r is freed by putfile */
 	return TRUE;
 }
@@ -587,23 +638,244 @@ X_cmd(Text *t, Cmd *cp)
 	return TRUE;
 }
 
+/*
+ * An Edit's |, < and > commands stream the selection to the
+ * command and its output back through pipes of their own: a
+ * streamwriter encodes the selection into the command's input
+ * as fast as it is read, and a streamreader decodes its output,
+ * which the editthread logs as it arrives.  The editthread reads
+ * the buffer a chunk at a time, so a slow reader holds it back.
+ */
+enum
+{
+	Streamchunk = 64*1024,	/* runes read or bytes written at a time */
+};
+
+typedef struct Stream Stream;
+typedef struct Streambuf Streambuf;
+
+struct Streambuf
+{
+	Rune	*r;
+	int	n;
+};
+
+struct Stream
+{
+	int	in;		/* to the command's input, or -1 */
+	int	out;		/* from its output, or -1 */
+	int	dead;		/* the command stopped reading */
+	Channel	*cin;	/* chan(Streambuf*) to the streamwriter; nil ends it */
+	Channel	*cout;	/* chan(Streambuf*) from the streamreader; nil at the end */
+	Channel	*done;	/* chan(void*); the streamwriter is finished */
+};
+
+static Streambuf*
+streambuf(int n)
+{
+	Streambuf *b;
+
+	b = emalloc(sizeof(Streambuf)+n*sizeof(Rune));
+	b->r = (Rune*)(b+1);
+	b->n = n;
+	return b;
+}
+
+static void
+streamwriter(void *v)
+{
+	Stream *s;
+	Streambuf *b;
+	char *p;
+	int m;
+
+	s = v;
+	threadsetname("streamwriter");
+	p = emalloc(Streamchunk*UTFmax);
+	while((b = recvp(s->cin)) != nil){
+		if(!s->dead){
+			m = cvttobytes(b->r, b->n, p);
+			if(write(s->in, p, m) != m)
+				s->dead = TRUE;
+		}
+		free(b);
+	}
+	free(p);
+	close(s->in);
+	sendp(s->done, nil);
+}
+
+static void
+streamreader(void *v)
+{
+	Stream *s;
+	Streambuf *b;
+	char *p;
+	int l, m, n, nb, nr;
+
+	s = v;
+	threadsetname("streamreader");
+	p = emalloc(Streamchunk+UTFmax+1);
+	m = 0;
+	n = 1;
+	/* as in loadfile, m bytes may be left over, possibly a partial rune */
+	while(n > 0){
+		n = read(s->out, p+m, Streamchunk);
+		if(n < 0)
+			n = 0;
+		m += n;
+		p[m] = 0;
+		l = m;
+		if(n > 0)
+			l -= UTFmax;
+		if(l <= 0)
+			continue;
+		b = streambuf(l);
+		cvttorunes(p, l, b->r, &nb, &nr, nil);
+		memmove(p, p+nb, m-nb);
+		m -= nb;
+		b->n = nr;
+		if(nr > 0)
+			sendp(s->cout, b);
+		else
+			free(b);
+	}
+	free(p);
+	close(s->out);
+	sendp(s->cout, nil);
+}
+
+/*
+ * Pipes for cmd; pfd gets the command's ends for run.
+ * Nil if they can't be made, and the command uses
+ * the rdsel and editout files instead.
+ */
+static Stream*
+streamopen(int cmd, int *pfd)
+{
+	Stream *s;
+	int p[2], i;
+
+	s = emalloc(sizeof(Stream));
+	s->in = s->out = -1;
+	pfd[0] = pfd[1] = -1;
+	if(cmd=='|' || cmd=='>'){
+		if(pipe(p) < 0)
+			goto Err;
+		pfd[0] = p[0];
+		s->in = p[1];
+	}
+	if(cmd=='|' || cmd=='<'){
+		if(pipe(p) < 0)
+			goto Err;
+		s->out = p[0];
+		pfd[1] = p[1];
+	}
+	/* other commands started meanwhile mustn't hold these open */
+	for(i=0; i<2; i++){
+		if(pfd[i] >= 0)
+			fcntl(pfd[i], F_SETFD, FD_CLOEXEC);
+	}
+	if(s->in >= 0)
+		fcntl(s->in, F_SETFD, FD_CLOEXEC);
+	if(s->out >= 0)
+		fcntl(s->out, F_SETFD, FD_CLOEXEC);
+	if(s->in >= 0){
+		s->cin = chancreate(sizeof(Streambuf*), 1);
+		s->done = chancreate(sizeof(void*), 0);
+		proccreate(streamwriter, s, STACK);
+	}
+	if(s->out >= 0){
+		s->cout = chancreate(sizeof(Streambuf*), 1);
+		proccreate(streamreader, s, STACK);
+	}
+	return s;
+
+Err:
+	if(s->in >= 0){
+		close(s->in);
+		close(pfd[0]);
+	}
+	free(s);
+	pfd[0] = pfd[1] = -1;
+	return nil;
+}
+
+/*
+ * Feed the command q0 to q1 of t, and log what it says as
+ * inserted at q1, until it is finished with both.
+ */
+static void
+streamrun(Stream *s, Text *t, uint q0, uint q1)
+{
+	Streambuf *in, *out;
+	File *f;
+	Alt a[3];
+	uint n;
+
+	f = t->file;
+	in = nil;
+	a[0].c = s->cin;
+	a[0].v = &in;
+	a[0].op = s->cin? CHANSND : CHANNOP;
+	a[1].c = s->cout;
+	a[1].v = &out;
+	a[1].op = s->cout? CHANRCV : CHANNOP;
+	a[2].op = CHANEND;
+	while(a[0].op!=CHANNOP || a[1].op!=CHANNOP){
+		if(a[0].op!=CHANNOP && in==nil && q0<q1 && !s->dead){
+			n = min(q1-q0, Streamchunk);
+			in = streambuf(n);
+			bufread(&f->b, q0, in->r, n);
+			q0 += n;
+		}
+		switch(alt(a)){
+		case 0:
+			if(in == nil)	/* sent the end */
+				a[0].op = CHANNOP;
+			in = nil;
+			break;
+		case 1:
+			if(out == nil){
+				a[1].op = CHANNOP;
+				break;
+			}
+			eloginsert(f, q1, out->r, out->n);
+			free(out);
+			break;
+		}
+	}
+	if(s->cin){
+		recvp(s->done);
+		chanfree(s->cin);
+		chanfree(s->done);
+	}
+	if(s->cout)
+		chanfree(s->cout);
+	free(s);
+}
+
 void
 runpipe(Text *t, int cmd, Rune *cr, int ncr, int state)
 {
 	Rune *r, *s;
-	int n;
+	int n, pfd[2];
+	uint q0, q1;
 	Runestr dir;
 	Window *w;
-	QLock *q;
+	QLock *lk;
+	Stream *sp;
+	Edstate *ed;
 
+	ed = edstate();
 	r = skipbl(cr, ncr, &n);
 	if(n == 0)
 		editerror("no command specified for %c", cmd);
 	w = nil;
 	if(state == Inserting){
 		w = t->w;
-		t->q0 = addr.r.q0;
-		t->q1 = addr.r.q1;
+		t->q0 = ed->addr.r.q0;
+		t->q1 = ed->addr.r.q1;
 		if(cmd == '<' || cmd=='|')
 			elogdelete(t->file, t->q0, t->q1);
 	}
@@ -621,31 +893,45 @@ runpipe(Text *t, int cmd, Rune *cr, int ncr, int state)
 		dir.nr = 0;
 	}
 	editing = state;
+	sp = nil;
+	q0 = q1 = 0;
+	if(w != nil){
+		sp = streamopen(cmd, pfd);
+		incref(&w->ref);	/* keep the body while streaming */
+		q0 = t->q0;
+		q1 = t->q1;
+	}
 	if(t!=nil && t->w!=nil)
 		incref(&t->w->ref);	/* run will decref */
-	run(w, runetobyte(s, n), dir.r, dir.nr, TRUE, nil, nil, TRUE);
+	run(w, runetobyte(s, n), dir.r, dir.nr, TRUE, nil, nil, TRUE, sp? pfd : nil);
 	free(s);
 	if(t!=nil && t->w!=nil)
 		winunlock(t->w);
 	qunlock(&row.lk);
+	if(sp != nil)
+		streamrun(sp, t, q0, q1);
 	recvul(cedit);
-	/*
-	 * The editoutlk exists only so that we can tell when
-	 * the editout file has been closed.  It can get closed *after*
-	 * the process exits because, since the process cannot be 
-	 * connected directly to editout (no 9P kernel support), 
-	 * the process is actually connected to a pipe to another
-	 * process (arranged via 9pserve) that reads from the pipe
-	 * and then writes the data in the pipe to editout using
-	 * 9P transactions.  This process might still have a couple
-	 * writes left to copy after the original process has exited.
-	 */
-	if(w)
-		q = &w->editoutlk;
-	else
-		q = &editoutlk;
-	qlock(q);	/* wait for file to close */
-	qunlock(q);
+	if(sp == nil){
+		/*
+		 * The editoutlk exists only so that we can tell when
+		 * the editout file has been closed.  It can get closed *after*
+		 * the process exits because, since the process cannot be 
+		 * connected directly to editout (no 9P kernel support), 
+		 * the process is actually connected to a pipe to another
+		 * process (arranged via 9pserve) that reads from the pipe
+		 * and then writes the data in the pipe to editout using
+		 * 9P transactions.  This process might still have a couple
+		 * writes left to copy after the original process has exited.
+		 */
+		if(w)
+			lk = &w->editoutlk;
+		else
+			lk = &editoutlk;
+		qlock(lk);	/* wait for file to close */
+		qunlock(lk);
+	}
+	if(w != nil)
+		winclose(w);
 	qlock(&row.lk);
 	editing = Inactive;
 	if(t!=nil && t->w!=nil)
@@ -662,41 +948,23 @@ pipe_cmd(Text *t, Cmd *cp)
 long
 nlcount(Text *t, long q0, long q1)
 {
-	long nl;
-	Rune *buf;
-	int i, nbuf;
-
-	buf = fbufalloc();
-	nbuf = 0;
-	i = nl = 0;
-	while(q0 < q1){
-		if(i == nbuf){
-			nbuf = q1-q0;
-			if(nbuf > RBUFSIZE)
-				nbuf = RBUFSIZE;
-			bufread(&t->file->b, q0, buf, nbuf);
-			i = 0;
-		}
-		if(buf[i++] == '\n')
-			nl++;
-		q0++;
-	}
-	fbuffree(buf);
-	return nl;
+	return bufnl(&t->file->b, q1) - bufnl(&t->file->b, q0);
 }
 
 void
 printposn(Text *t, int charsonly)
 {
 	long l1, l2;
+	Edstate *ed;
 
+	ed = edstate();
 	if (t != nil && t->file != nil && t->file->name != nil)
 		warning(nil, "%.*S:", t->file->nname, t->file->name);
 	if(!charsonly){
-		l1 = 1+nlcount(t, 0, addr.r.q0);
-		l2 = l1+nlcount(t, addr.r.q0, addr.r.q1);
+		l1 = 1+nlcount(t, 0, ed->addr.r.q0);
+		l2 = l1+nlcount(t, ed->addr.r.q0, ed->addr.r.q1);
 		/* check if addr ends with '\n' */
-		if(addr.r.q1>0 && addr.r.q1>addr.r.q0 && textreadc(t, addr.r.q1-1)=='\n')
+		if(ed->addr.r.q1>0 && ed->addr.r.q1>ed->addr.r.q0 && textreadc(t, ed->addr.r.q1-1)=='\n')
 			--l2;
 		warning(nil, "%lud", l1);
 		if(l2 != l1)
@@ -704,9 +972,9 @@ printposn(Text *t, int charsonly)
 		warning(nil, "\n");
 		return;
 	}
-	warning(nil, "#%d", addr.r.q0);
-	if(addr.r.q1 != addr.r.q0)
-		warning(nil, ",#%d", addr.r.q1);
+	warning(nil, "#%d", ed->addr.r.q0);
+	if(ed->addr.r.q1 != ed->addr.r.q0)
+		warning(nil, ",#%d", ed->addr.r.q1);
 	warning(nil, "\n");
 }
 
@@ -737,20 +1005,22 @@ nl_cmd(Text *t, Cmd *cp)
 {
 	Address a;
 	File *f;
+	Edstate *ed;
 
+	ed = edstate();
 	f = t->file;
 	if(cp->addr == 0){
 		/* First put it on newline boundaries */
 		mkaddr(&a, f);
-		addr = lineaddr(0, a, -1);
+		ed->addr = lineaddr(0, a, -1);
 		a = lineaddr(0, a, 1);
-		addr.r.q1 = a.r.q1;
-		if(addr.r.q0==t->q0 && addr.r.q1==t->q1){
+		ed->addr.r.q1 = a.r.q1;
+		if(ed->addr.r.q0==t->q0 && ed->addr.r.q1==t->q1){
 			mkaddr(&a, f);
-			addr = lineaddr(1, a, 1);
+			ed->addr = lineaddr(1, a, 1);
 		}
 	}
-	textshow(t, addr.r.q0, addr.r.q1, 1);
+	textshow(t, ed->addr.r.q0, ed->addr.r.q1, 1);
 	return TRUE;
 }
 
@@ -770,9 +1040,11 @@ pdisplay(File *f)
 	long p1, p2;
 	int np;
 	Rune *buf;
+	Edstate *ed;
 
-	p1 = addr.r.q0;
-	p2 = addr.r.q1;
+	ed = edstate();
+	p1 = ed->addr.r.q0;
+	p2 = ed->addr.r.q1;
 	if(p2 > f->b.nc)
 		p2 = f->b.nc;
 	buf = fbufalloc();
@@ -786,8 +1058,8 @@ pdisplay(File *f)
 		p1 += np;
 	}
 	fbuffree(buf);
-	f->curtext->q0 = addr.r.q0;
-	f->curtext->q1 = addr.r.q1;
+	f->curtext->q0 = ed->addr.r.q0;
+	f->curtext->q1 = ed->addr.r.q1;
 	return TRUE;
 }
 
@@ -819,45 +1091,19 @@ loopcmd(File *f, Cmd *cp, Range *rp, long nrp)
 void
 looper(File *f, Cmd *cp, int xy)
 {
-	long p, op, nrp;
-	Range r, tr;
+	int nrp;
 	Range *rp;
+	Regexp *re;
+	Edstate *ed;
 
-	r = addr.r;
-	op= xy? -1 : r.q0;
-	nest++;
-	if(rxcompile(cp->re->r) == FALSE)
+	ed = edstate();
+	ed->nest++;
+	if((re = editregexp(cp->re)) == nil)
 		editerror("bad regexp in %c command", cp->cmdc);
-	nrp = 0;
-	rp = nil;
-	for(p = r.q0; p<=r.q1; ){
-		if(!rxexecute(f->curtext, nil, p, r.q1, &sel)){ /* no match, but y should still run */
-			if(xy || op>r.q1)
-				break;
-			tr.q0 = op, tr.q1 = r.q1;
-			p = r.q1+1;	/* exit next loop */
-		}else{
-			if(sel.r[0].q0==sel.r[0].q1){	/* empty match? */
-				if(sel.r[0].q0==op){
-					p++;
-					continue;
-				}
-				p = sel.r[0].q1+1;
-			}else
-				p = sel.r[0].q1;
-			if(xy)
-				tr = sel.r[0];
-			else
-				tr.q0 = op, tr.q1 = sel.r[0].q0;
-		}
-		op = sel.r[0].q1;
-		nrp++;
-		rp = erealloc(rp, nrp*sizeof(Range));
-		rp[nrp-1] = tr;
-	}
+	rp = rxmatches(re, f->curtext, ed->addr.r.q0, ed->addr.r.q1, !xy, &nrp);
 	loopcmd(f, cp->u.cmd, rp, nrp);
 	free(rp);
-	--nest;
+	--ed->nest;
 }
 
 void
@@ -867,11 +1113,13 @@ linelooper(File *f, Cmd *cp)
 	Range r, linesel;
 	Address a, a3;
 	Range *rp;
+	Edstate *ed;
 
-	nest++;
+	ed = edstate();
+	ed->nest++;
 	nrp = 0;
 	rp = nil;
-	r = addr.r;
+	r = ed->addr.r;
 	a3.f = f;
 	a3.r.q0 = a3.r.q1 = r.q0;
 	a = lineaddr(0, a3, 1);
@@ -898,7 +1146,7 @@ linelooper(File *f, Cmd *cp)
 	}
 	loopcmd(f, cp->u.cmd, rp, nrp);
 	free(rp);
-	--nest;
+	--ed->nest;
 }
 
 struct Looper
@@ -944,14 +1192,216 @@ alllocker(Window *w, void *v)
 		winclose(w);
 }
 
+/*
+ * X and Y hand a command that touches only the file it runs on
+ * to a pool of editprocs, one file per proc at a time.  Each proc
+ * keeps its address, match and nesting in an Edstate of its own,
+ * and the edit logs it leaves are applied by allupdate, in window
+ * order, once the whole Edit is done.
+ */
+struct Edpool
+{
+	QLock	lk;
+	Cmd	*cp;
+	Window	**w;
+	int	nw;
+	int	next;		/* next window to hand out */
+	int	nest;
+	int	*pos;		/* of each window in the X's order */
+	char	*err;		/* from the first window, by position, that failed */
+	int	ierr;
+	Channel	*done;	/* chan(void*); an editproc is finished */
+};
+
+static	int	neditproc;
+
+static int
+addrlocal(Addr *ap)
+{
+	for(; ap; ap=ap->next){
+		if(ap->type == '"')
+			return FALSE;
+		if((ap->type==',' || ap->type==';') && !addrlocal(ap->u.left))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Can cp run on an editproc?  Its default addresses are filled
+ * in here, so that cmdexec need not change the tree the procs share.
+ */
+static int
+filelocal(Cmd *cp)
+{
+	int i;
+
+	i = cmdlookup(cp->cmdc);
+	if(i>=0 && cmdtab[i].defaddr!=aNo)
+		defaddr(cp, cmdtab[i].defaddr);
+	if(!addrlocal(cp->addr))
+		return FALSE;
+	switch(cp->cmdc){
+	case 'a':
+	case 'c':
+	case 'd':
+	case 'i':
+	case 's':
+		return TRUE;
+	case 'm':
+	case 't':
+		return addrlocal(cp->u.mtaddr);
+	case 'g':
+	case 'v':
+	case 'x':
+	case 'y':
+		return filelocal(cp->u.cmd);
+	case '{':
+		for(cp=cp->u.cmd; cp; cp=cp->next)
+			if(!filelocal(cp))
+				return FALSE;
+		return TRUE;
+	}
+	return FALSE;	/* prints, or reaches past the file */
+}
+
+static void
+editproc(void *v)
+{
+	Edpool *p;
+	Edstate e;
+	int i;
+
+	p = v;
+	threadsetname("editproc");
+	memset(&e, 0, sizeof e);
+	e.pool = p;
+	*threaddata() = &e;
+	for(;;){
+		qlock(&p->lk);
+		i = p->next;
+		if(i < p->nw)
+			p->next++;
+		qunlock(&p->lk);
+		if(i >= p->nw)
+			break;
+		e.i = p->pos[i];
+		e.nest = p->nest;
+		cmdexec(&p->w[i]->body, p->cp);
+	}
+	sendp(p->done, nil);
+}
+
+/* editerror, on an editproc */
+void
+editprocerror(char *s)
+{
+	Edstate *e;
+	Edpool *p;
+
+	e = edstate();
+	p = e->pool;
+	qlock(&p->lk);
+	/* a proc on an earlier window may fail later; keep the error from the first window */
+	if(p->err==nil || e->i<p->ierr){
+		free(p->err);
+		p->err = s;
+		p->ierr = e->i;
+	}else
+		free(s);
+	p->next = p->nw;
+	qunlock(&p->lk);
+	sendp(p->done, nil);
+	threadexits(nil);
+}
+
+/*
+ * Run cp over the windows of w on the editprocs.  The threads left
+ * in this proc may run while the editthread waits, so each window
+ * is locked for the duration; any that can't be, such as the one
+ * the Edit came from, are done here afterwards instead.
+ */
+static void
+parlooper(Cmd *cp, Window **w, int nw)
+{
+	Edpool p;
+	int i, n, nsw, ierr;
+	char err[ERRMAX];
+	static Window **sw;
+	static int *swpos;
+
+	if(neditproc == 0){
+		neditproc = envint("editprocs", sysconf(_SC_NPROCESSORS_ONLN));
+		if(neditproc < 1)
+			neditproc = 1;
+	}
+	if(neditproc == 1){
+		for(i=0; i<nw; i++)
+			cmdexec(&w[i]->body, cp);
+		return;
+	}
+	memset(&p, 0, sizeof p);
+	p.cp = cp;
+	p.nest = edstate()->nest;
+	p.w = emalloc(nw*sizeof(Window*));
+	p.pos = emalloc(nw*sizeof(int));
+	free(sw);	/* error'ed out last time */
+	free(swpos);
+	sw = emalloc(nw*sizeof(Window*));
+	swpos = emalloc(nw*sizeof(int));
+	nsw = 0;
+	for(i=0; i<nw; i++)
+		if(wincanlock(w[i], 'E')){
+			p.pos[p.nw] = i;
+			p.w[p.nw++] = w[i];
+		}else{
+			swpos[nsw] = i;
+			sw[nsw++] = w[i];
+		}
+	if(p.nw > 0){
+		n = min(neditproc, p.nw);
+		p.done = chancreate(sizeof(void*), n);
+		for(i=0; i<n; i++)
+			proccreate(editproc, &p, STACK);
+		for(i=0; i<n; i++)
+			recvp(p.done);
+		chanfree(p.done);
+	}
+	for(i=0; i<p.nw; i++)
+		winunlock(p.w[i]);
+	free(p.w);
+	free(p.pos);
+	ierr = nw;
+	if(p.err != nil){
+		snprint(err, sizeof err, "%s", p.err);
+		free(p.err);
+		ierr = p.ierr;
+	}
+	/*
+	 * The windows that couldn't be locked run here, as they would
+	 * have serially: those before a failed one, whose error, if
+	 * they fail too, comes first.
+	 */
+	for(i=0; i<nsw && swpos[i]<ierr; i++)
+		cmdexec(&sw[i]->body, cp);
+	free(sw);
+	free(swpos);
+	sw = nil;
+	swpos = nil;
+	if(ierr < nw)
+		editerror("%s", err);
+}
+
 void
 filelooper(Cmd *cp, int XY)
 {
 	int i;
+	Edstate *ed;
 
+	ed = edstate();
 	if(Glooping++)
 		editerror("can't nest %c command", "YX"[XY]);
-	nest++;
+	ed->nest++;
 
 	loopstruct.cp = cp;
 	loopstruct.XY = XY;
@@ -968,38 +1418,45 @@ filelooper(Cmd *cp, int XY)
 	 */
 	allwindows(alllocker, (void*)1);
 	globalincref = 1;
-	for(i=0; i<loopstruct.nw; i++)
-		cmdexec(&loopstruct.w[i]->body, cp->u.cmd);
+	if(loopstruct.nw>1 && filelocal(cp->u.cmd))
+		parlooper(cp->u.cmd, loopstruct.w, loopstruct.nw);
+	else
+		for(i=0; i<loopstruct.nw; i++)
+			cmdexec(&loopstruct.w[i]->body, cp->u.cmd);
 	allwindows(alllocker, (void*)0);
 	globalincref = 0;
 	free(loopstruct.w);
 	loopstruct.w = nil;
 
 	--Glooping;
-	--nest;
+	--ed->nest;
 }
 
 void
 nextmatch(File *f, String *r, long p, int sign)
 {
-	if(rxcompile(r->r) == FALSE)
+	Regexp *re;
+	Edstate *ed;
+
+	ed = edstate();
+	if((re = editregexp(r)) == nil)
 		editerror("bad regexp in command address");
 	if(sign >= 0){
-		if(!rxexecute(f->curtext, nil, p, 0x7FFFFFFFL, &sel))
+		if(!rxexecute(re, f->curtext, nil, p, 0x7FFFFFFFL, &ed->sel))
 			editerror("no match for regexp");
-		if(sel.r[0].q0==sel.r[0].q1 && sel.r[0].q0==p){
+		if(ed->sel.r[0].q0==ed->sel.r[0].q1 && ed->sel.r[0].q0==p){
 			if(++p>f->b.nc)
 				p = 0;
-			if(!rxexecute(f->curtext, nil, p, 0x7FFFFFFFL, &sel))
+			if(!rxexecute(re, f->curtext, nil, p, 0x7FFFFFFFL, &ed->sel))
 				editerror("address");
 		}
 	}else{
-		if(!rxbexecute(f->curtext, p, &sel))
+		if(!rxbexecute(re, f->curtext, p, &ed->sel))
 			editerror("no match for regexp");
-		if(sel.r[0].q0==sel.r[0].q1 && sel.r[0].q1==p){
+		if(ed->sel.r[0].q0==ed->sel.r[0].q1 && ed->sel.r[0].q1==p){
 			if(--p<0)
 				p = f->b.nc;
-			if(!rxbexecute(f->curtext, p, &sel))
+			if(!rxbexecute(re, f->curtext, p, &ed->sel))
 				editerror("address");
 		}
 	}
@@ -1042,7 +1499,7 @@ editerror("can't handle '");
 			/* fall through */
 		case '/':
 			nextmatch(f, ap->u.re, sign>=0? a.r.q1 : a.r.q0, sign);
-			a.r = sel.r[0];
+			a.r = edstate()->sel.r[0];
 			break;
 
 		case '"':
@@ -1178,9 +1635,10 @@ filematch(File *f, String *r)
 	Window *w;
 	int match, i, dirty;
 	Rangeset s;
+	Regexp *re;
 
 	/* compile expr first so if we get an error, we haven't allocated anything */
-	if(rxcompile(r->r) == FALSE)
+	if((re = editregexp(r)) == nil)
 		editerror("bad regexp in file match");
 	buf = fbufalloc();
 	w = f->curtext->w;
@@ -1190,7 +1648,7 @@ filematch(File *f, String *r)
 		'+', " ."[curtext!=nil && curtext->file==f], f->nname, f->name);
 	rbuf = bytetorune(buf, &i);
 	fbuffree(buf);
-	match = rxexecute(nil, rbuf, 0, i, &s);
+	match = rxexecute(re, nil, rbuf, 0, i, &s);
 	free(rbuf);
 	return match;
 }
@@ -1209,6 +1667,65 @@ charaddr(long l, Address addr, int sign)
 	return addr;
 }
 
+/*
+ * lineaddr by the buffer's newline counts, as addr.c's linenumber,
+ * so a far line costs no more than a near one.  The text must have
+ * no typing in its cache.
+ */
+static Address
+nllineaddr(long l, Address addr, int sign)
+{
+	Buffer *b;
+	Address a;
+	uint k, nl, p;
+
+	b = &addr.f->b;
+	nl = bufnl(b, b->nc);
+	a.f = addr.f;
+	if(sign >= 0){
+		if(l == 0){
+			if(sign==0 || addr.r.q1==0){
+				a.r.q0 = a.r.q1 = 0;
+				return a;
+			}
+			a.r.q0 = addr.r.q1;
+			p = addr.r.q1-1;
+		}else{
+			/* line l starts after the k'th newline */
+			if(l-1 > nl)
+				editerror("address out of range");
+			if(sign==0 || addr.r.q1==0)
+				k = l-1;
+			else
+				k = bufnl(b, addr.r.q1-1)+l;
+			if(k > nl)
+				editerror("address out of range");
+			p = bufnlpos(b, k);
+			a.r.q0 = p;
+		}
+		k = bufnl(b, p);
+		a.r.q1 = k<nl? bufnlpos(b, k+1) : b->nc;
+	}else{
+		p = addr.r.q0;
+		if(l == 0)
+			a.r.q1 = p;
+		else{
+			k = bufnl(b, p);
+			if(l-1 > k)
+				editerror("address out of range");
+			if(l-1 == k)
+				p = 0;
+			else
+				p = bufnlpos(b, k-l+1);
+			a.r.q1 = p;
+			if(p > 0)
+				p--;
+		}
+		a.r.q0 = bufnlpos(b, bufnl(b, p));	/* lines start after a newline */
+	}
+	return a;
+}
+
 Address
 lineaddr(long l, Address addr, int sign)
 {
@@ -1218,6 +1735,8 @@ lineaddr(long l, Address addr, int sign)
 	Address a;
 	long p;
 
+	if(f->curtext->ncache == 0)
+		return nllineaddr(l, addr, sign);
 	a.f = f;
 	if(sign >= 0){
 		if(l == 0){
@@ -69,6 +69,9 @@ int	patset;
 List	cmdlist;
 List	addrlist;
 List	stringlist;
+List	relist;		/* Regexp* compiled for the strings in restrlist */
+List	restrlist;
+QLock	relk;
 Text	*curtext;
 int	editing = Inactive;
 
@@ -141,6 +144,8 @@ editerror(char *fmt, ...)
 	va_start(arg, fmt);
 	s = vsmprint(fmt, arg);
 	va_end(arg);
+	if(edstate()->pool)
+		editprocerror(s);	/* does not return */
 	freecmd();
 	allwindows(allelogterm, nil);	/* truncate the edit logs */
 	sendp(editerrc, s);
@@ -355,6 +360,35 @@ freecmd(void)
 		i = --stringlist.nused;
 		freestring(stringlist.u.stringptr[i]);
 	}
+	while(relist.nused > 0)
+		rxfree(relist.u.ptr[--relist.nused]);
+	restrlist.nused = 0;
+}
+
+/*
+ * The compiled form of re, kept until the command is freed;
+ * nil if it will not compile.
+ */
+Regexp*
+editregexp(String *re)
+{
+	Regexp *p;
+	int i;
+
+	qlock(&relk);	/* editprocs share the lists */
+	for(i=0; i<restrlist.nused; i++)
+		if(restrlist.u.stringptr[i] == re){
+			p = relist.u.ptr[i];
+			qunlock(&relk);
+			return p;
+		}
+	p = rxcompile(re->r);
+	if(p != nil){
+		inslist(&relist, relist.nused, p);
+		inslist(&restrlist, restrlist.nused, re);
+	}
+	qunlock(&relk);
+	return p;
 }
 
 void
@@ -3,6 +3,8 @@
 typedef struct Addr	Addr;
 typedef struct Address	Address;
 typedef struct Cmd	Cmd;
+typedef struct Edpool	Edpool;
+typedef struct Edstate	Edstate;
 typedef struct List	List;
 typedef struct String	String;
 
@@ -30,6 +32,15 @@ struct Address
 	File	*f;
 };
 
+struct Edstate	/* what a thread running commands keeps to itself */
+{
+	Address	addr;		/* range the command applies to */
+	Rangeset	sel;		/* from the last regexp search */
+	int	nest;		/* depth of x, y, g, v, X and Y */
+	Edpool	*pool;		/* editproc's pool, or nil on the editthread */
+	int	i;		/* position, in the X, of the window running */
+};
+
 struct Cmd
 {
 	Addr	*addr;			/* address (range of text) */
@@ -90,10 +101,13 @@ int	eq_cmd(Text*, Cmd*);
 String	*allocstring(int);
 void		freestring(String*);
 String	*getregexp(int);
+Regexp	*editregexp(String*);
 Addr	*newaddr(void);
 Address	cmdaddress(Addr*, Address, int);
 int	cmdexec(Text*, Cmd*);
 void	editerror(char*, ...);
+void	editprocerror(char*);
+Edstate	*edstate(void);
 int	cmdlookup(int);
 void	resetxec(void);
 void	Straddc(String*, int);
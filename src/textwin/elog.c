@@ -46,7 +46,8 @@ enum
 enum
 {
 	Minstring = 16,		/* distance beneath which we merge changes */
-	Maxstring = RBUFSIZE	/* maximum length of change we will merge into one */
+	Maxstring = RBUFSIZE,	/* maximum length of change we will merge into one */
+	Manychanges = 1024	/* changes beyond which the file may be rebuilt in one pass */
 };
 
 void
@@ -211,6 +212,142 @@ elogdelete(File *f, int q0, int q1)
 	f->elog.nd = q1-q0;
 }
 
+/* append q0 to q1 of from to the end of to */
+static void
+bufcopy(Buffer *to, Buffer *from, uint q0, uint q1, Rune *buf)
+{
+	uint n;
+
+	for(; q0<q1; q0+=n){
+		n = q1-q0;
+		if(n > RBUFSIZE)
+			n = RBUFSIZE;
+		bufread(from, q0, buf, n);
+		bufinsert(to, to->nc, buf, n);
+	}
+}
+
+/*
+ * Apply a long log in one pass, merging it with the text into a new
+ * Buffer, rather than a change at a time.  The undo records are the
+ * ones the changes would have made, all under the one sequence, and
+ * each text is moved as the changes would have moved it.  Returns
+ * FALSE, having done nothing, if the log is short for the size of
+ * the file, if its changes are out of order, or if a window on the
+ * file is reporting events, which want every change.
+ */
+static int
+elogrebuild(File *f, Text *t)
+{
+	Buflog b, *lb, *l;
+	Buffer *log, nb;
+	Rune *buf;
+	uint i, k, n, p, q, up, *lup;
+	Text *u;
+
+	log = f->elogbuf;
+	if(warned)
+		return FALSE;
+	for(k=0; k<f->ntext; k++){
+		u = f->text[k];
+		if(u->ncache!=0 || (u->w!=nil && u->w->nopen[QWevent]>0))
+			return FALSE;
+	}
+	n = 0;
+	for(up=log->nc; up>0; n++){
+		up -= Buflogsize;
+		bufread(log, up, (Rune*)&b, Buflogsize);
+		if(b.type!=Replace && b.type!=Insert && b.type!=Delete)
+			return FALSE;
+		if(b.type != Delete)
+			up -= b.nr;
+	}
+	if(n<Manychanges || n<f->b.nc/Maxblock)
+		return FALSE;
+
+	/* the changes in file order, with where their runes are in the log */
+	lb = emalloc(n*sizeof(Buflog));
+	lup = emalloc(n*sizeof(uint));
+	i = n;
+	for(up=log->nc; up>0; ){
+		up -= Buflogsize;
+		l = &lb[--i];
+		bufread(log, up, (Rune*)l, Buflogsize);
+		if(l->type == Delete)
+			l->nr = 0;
+		up -= l->nr;
+		lup[i] = up;
+	}
+	p = 0;
+	for(i=0; i<n; i++){
+		if(lb[i].q0<p || lb[i].q0+lb[i].nd>f->b.nc){
+			free(lb);
+			free(lup);
+			return FALSE;
+		}
+		p = lb[i].q0+lb[i].nd;
+	}
+
+	filemark(f);
+	if(f->seq > 0)
+		for(i=n; i-->0; ){
+			l = &lb[i];
+			if(l->nd > 0){
+				fileundelete(f, &f->delta, l->q0, l->q0+l->nd);
+				f->mod = TRUE;
+			}
+			if(l->nr > 0){
+				fileuninsert(f, &f->delta, l->q0, l->nr);
+				f->mod = TRUE;
+			}
+		}
+	f->mod = TRUE;
+
+	buf = fbufalloc();
+	memset(&nb, 0, sizeof nb);
+	p = 0;
+	for(i=0; i<n; i++){
+		l = &lb[i];
+		bufcopy(&nb, &f->b, p, l->q0, buf);
+		bufcopy(&nb, log, lup[i], lup[i]+l->nr, buf);
+		p = l->q0+l->nd;
+	}
+	bufcopy(&nb, &f->b, p, f->b.nc, buf);
+	fbuffree(buf);
+	bufclose(&f->b);
+	f->b = nb;
+
+	/* as textdelete and textinsert would have, last change first */
+	for(k=0; k<f->ntext; k++){
+		u = f->text[k];
+		for(i=n; i-->0; ){
+			l = &lb[i];
+			q = l->q0;
+			if(q < u->q0)
+				u->q0 -= min(l->nd, u->q0-q);
+			if(q < u->q1)
+				u->q1 -= min(l->nd, u->q1-q);
+			if(q < u->org)
+				u->org -= min(l->nd, u->org-q);
+			if(q < u->q1)
+				u->q1 += l->nr;
+			if(q < u->q0)
+				u->q0 += l->nr;
+			if(q < u->org)
+				u->org += l->nr;
+			if(u==t && u->q0==q && u->q1==q)
+				u->q1 += l->nr;
+		}
+		if(u->w != nil){
+			u->w->dirty = TRUE;
+			u->w->utflastqid = -1;
+		}
+	}
+	free(lb);
+	free(lup);
+	return TRUE;
+}
+
 #define tracelog 0
 void
 elogapply(File *f)
@@ -220,7 +357,7 @@ elogapply(File *f)
 	uint i, n, up, mod;
 	uint tq0, tq1;
 	Buffer *log;
-	Text *t;
+	Text *t, *u;
 	int owner;
 
 	elogflush(f);
@@ -246,6 +383,13 @@ elogapply(File *f)
 	 * inserted text.
 	 */
 
+	/*
+	 * The frames are left alone while the log is applied and redrawn
+	 * once at the end; only the origins and selections follow along.
+	 */
+	for(i=0; i<f->ntext; i++)
+		f->text[i]->nodraw = TRUE;
+
 	/*
 	 * We constrain the addresses in here (with textconstrain()) because
 	 * overlapping changes will generate bogus addresses.   We will warn
@@ -253,6 +397,8 @@ elogapply(File *f)
 	 * keep things in range.
 	 */
 
+	if(elogrebuild(f, t))
+		bufreset(log);
 	while(log->nc > 0){
 		up = log->nc-Buflogsize;
 		bufread(log, up, (Rune*)&b, Buflogsize);
@@ -348,6 +494,15 @@ elogapply(File *f)
 		t->q0 = min(t->q0, t->q1);
 	}
 
+	for(i=0; i<f->ntext; i++){
+		u = f->text[i];
+		textrefresh(u);
+		if(u != t){
+			textsetselect(u, u->q0, u->q1);
+			textscrdraw(u);
+		}
+	}
+
 	if(t->w)
 		t->w->owner = owner;
 }
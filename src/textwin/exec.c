@@ -252,7 +252,7 @@ execute(Text *t, uint aq0, uint aq1, int external, Text *argt)
 	aa = getbytearg(argt, TRUE, TRUE, &a);
 	if(t->w)
 		incref(&t->w->ref);
-	run(t->w, b, dir.r, dir.nr, TRUE, aa, a, FALSE);
+	run(t->w, b, dir.r, dir.nr, TRUE, aa, a, FALSE, nil);
 }
 
 char*
@@ -655,6 +655,9 @@ putfile(File *f, int q0, int q1, Rune *namer, int nname)
 			goto Rescue1;
 		}
 	}
+	/* lazily loaded blocks may be reading the file about to be rewritten */
+	if(d != nil)
+		disksettle(disk, d);
 	fd = create(name, OWRITE, 0666);
 	if(fd < 0){
 		warning(nil, "can't create file %s: %r\n", name);
@@ -675,7 +678,7 @@ putfile(File *f, int q0, int q1, Rune *namer, int nname)
 		if(n > BUFSIZE/UTFmax)
 			n = BUFSIZE/UTFmax;
 		bufread(&f->b, q, r, n);
-		m = snprint(s, BUFSIZE+1, "%.*S", n, r);
+		m = cvttobytes(r, n, s);
 		if(write(fd, s, m) != m){
 			warning(nil, "can't write file %s: %r\n", name);
 			goto Rescue2;
@@ -1059,7 +1062,7 @@ local(Text *et, Text *_0, Text *argt, int _1, int _2, Rune *arg, int narg)
 		dir.r = nil;
 		dir.nr = 0;
 	}
-	run(nil, runetobyte(arg, narg), dir.r, dir.nr, FALSE, aa, a, FALSE);
+	run(nil, runetobyte(arg, narg), dir.r, dir.nr, FALSE, aa, a, FALSE, nil);
 }
 
 void
@@ -1316,6 +1319,16 @@ tab(Text *et, Text *_0, Text *argt, int _1, int _2, Rune *arg, int narg)
 		warning(nil, "%.*S: Tab %d\n", w->body.file->nname, w->body.file->name, w->body.tabstop);
 }
 
+/* the ends of an Edit's pipes that runproc won't get to hand over */
+static void
+closepfd(int *pfd)
+{
+	if(pfd[0] >= 0)
+		close(pfd[0]);
+	if(pfd[1] >= 0)
+		close(pfd[1]);
+}
+
 void
 runproc(void *argvp)
 {
@@ -1330,6 +1343,7 @@ runproc(void *argvp)
 		Command *c;
 		Channel *cpid;
 		int iseditcmd;
+		int pfd[2];
 	/* end of args */
 	char *e, *t, *name, *filename, *dir, **av, *news;
 	Rune r, **incl;
@@ -1357,6 +1371,8 @@ runproc(void *argvp)
 	c = argv[7];
 	cpid = argv[8];
 	iseditcmd = (uintptr)argv[9];
+	pfd[0] = (uintptr)argv[10];
+	pfd[1] = (uintptr)argv[11];
 	free(argv);
 
 	t = s;
@@ -1411,6 +1427,7 @@ runproc(void *argvp)
 		c->md = fsysmount(rdir, ndir, incl, nincl);
 		if(c->md == nil){
 			fprint(2, "child: can't allocate mntdir: %r\n");
+			closepfd(pfd);
 			threadexits("fsysmount");
 		}
 		sprint(buf, "%d", c->md->id);
@@ -1418,22 +1435,29 @@ runproc(void *argvp)
 			fprint(2, "child: can't mount textwin: %r\n");
 			fsysdelid(c->md);
 			c->md = nil;
+			closepfd(pfd);
 			threadexits("nsmount");
 		}
-		if(winid>0 && (pipechar=='|' || pipechar=='>')){
+		if(pfd[0] >= 0)
+			sfd[0] = pfd[0];
+		else if(winid>0 && (pipechar=='|' || pipechar=='>')){
 			sprint(buf, "%d/rdsel", winid);
 			sfd[0] = fsopenfd(fs, buf, OREAD);
 		}else
 			sfd[0] = open("/dev/null", OREAD);
 		if((winid>0 || iseditcmd) && (pipechar=='|' || pipechar=='<')){
-			if(iseditcmd){
-				if(winid > 0)
-					sprint(buf, "%d/editout", winid);
-				else
-					sprint(buf, "editout");
-			}else
-				sprint(buf, "%d/wrsel", winid);
-			sfd[1] = fsopenfd(fs, buf, OWRITE);
+			if(pfd[1] >= 0)
+				sfd[1] = pfd[1];
+			else{
+				if(iseditcmd){
+					if(winid > 0)
+						sprint(buf, "%d/editout", winid);
+					else
+						sprint(buf, "editout");
+				}else
+					sprint(buf, "%d/wrsel", winid);
+				sfd[1] = fsopenfd(fs, buf, OWRITE);
+			}
 			sfd[2] = fsopenfd(fs, "cons", OWRITE);
 		}else{
 			sfd[1] = fsopenfd(fs, "cons", OWRITE);
@@ -1616,8 +1640,13 @@ runwaittask(void *v)
 	chanfree(cpid);
 }
 
+/*
+ * pfd, if not nil, holds the ends of pipes an Edit command streams
+ * through; pfd[0] for its standard input and pfd[1] for its output,
+ * or -1 for the usual rdsel and editout files.
+ */
 void
-run(Window *win, char *s, Rune *rdir, int ndir, int newns, char *argaddr, char *xarg, int iseditcmd)
+run(Window *win, char *s, Rune *rdir, int ndir, int newns, char *argaddr, char *xarg, int iseditcmd, int *pfd)
 {
 	void **arg;
 	Command *c;
@@ -1626,7 +1655,7 @@ run(Window *win, char *s, Rune *rdir, int ndir, int newns, char *argaddr, char *
 	if(s == nil)
 		return;
 
-	arg = emalloc(10*sizeof(void*));
+	arg = emalloc(12*sizeof(void*));
 	c = emalloc(sizeof *c);
 	cpid = chancreate(sizeof(ulong), 0);
 	chansetname(cpid, "cpid %s", s);
@@ -1640,6 +1669,8 @@ run(Window *win, char *s, Rune *rdir, int ndir, int newns, char *argaddr, char *
 	arg[7] = c;
 	arg[8] = cpid;
 	arg[9] = (void*)(uintptr)iseditcmd;
+	arg[10] = (void*)(uintptr)(pfd? pfd[0] : -1);
+	arg[11] = (void*)(uintptr)(pfd? pfd[1] : -1);
 	threadcreate(runproc, arg, STACK);
 	/* mustn't block here because must be ready to answer mount() call in run() */
 	arg = emalloc(2*sizeof(void*));
@@ -33,15 +33,136 @@ struct Undo
 
 enum
 {
-	Undosize = sizeof(Undo)/sizeof(Rune)
+	Undosize = sizeof(Undo)/sizeof(Rune),
+	Undomem = 64	/* default undo budget per file, megabytes */
 };
 
+/*
+ * Drop the oldest changes from the bottom of delta once it is over
+ * the file's budget, down to three quarters of it so the cost of the
+ * bufdelete is shared by many changes.  The newest change is kept.
+ */
+static void
+undotrim(File *f)
+{
+	int i, k;
+	uint n;
+
+	if(f->nundop < 2)
+		return;
+	k = 0;
+	if(f->undomax>0 && f->nundop>f->undomax)
+		k = f->nundop - (f->undomax-f->undomax/4);
+	if(f->undomem>0 && f->delta.nc>f->undomem/sizeof(Rune)){
+		n = f->delta.nc - f->undomem/sizeof(Rune)/4*3;
+		while(k<f->nundop-1 && f->undop[k]<n)
+			k++;
+	}
+	if(k > f->nundop-1)
+		k = f->nundop-1;
+	if(k <= 0)
+		return;
+	n = f->undop[k];
+	bufdelete(&f->delta, 0, n);
+	f->nundop -= k;
+	for(i=0; i<f->nundop; i++)
+		f->undop[i] = f->undop[i+k] - n;
+}
+
+/*
+ * Can the record on top of delta, the whole of a sequence begun by
+ * a keystroke or a body write, take in u, made by the next such?
+ * Every key typed in a body is a sequence of its own, but a run of
+ * them is better undone at once.
+ */
+static int
+undotyped(File *f, Buffer *delta, Undo *top, Undo *u)
+{
+	uint n;
+
+	if(delta!=&f->delta || f->nundop==0 || top->seq!=f->jointop || u->seq!=f->joinseq)
+		return FALSE;
+	n = delta->nc-Undosize;
+	if(top->type != Delete)
+		n -= top->n;
+	return f->undop[f->nundop-1] == n;
+}
+
+/*
+ * Called before change u is logged in delta.  If u and the record
+ * on top, left in *top, make one change - text typed on at either
+ * end of an insertion, or erased at either end of a deletion - returns
+ * where u's text belongs in delta, and the record is to be widened,
+ * taking u's sequence, instead of u added.  Otherwise returns ~0,
+ * noting where a new sequence begins in f->delta.
+ */
+static uint
+undojoin(File *f, Buffer *delta, Undo *u, Undo *top)
+{
+	uint n, q;
+
+	q = ~0;
+	if(delta->nc > 0){
+		n = delta->nc-Undosize;
+		bufread(delta, n, (Rune*)top, Undosize);
+		if(top->type==u->type && (top->seq==u->seq || undotyped(f, delta, top, u)))
+			switch(u->type){
+			case Delete:	/* undoes insertions */
+				if(u->p0==top->p0 || u->p0==top->p0+top->n)
+					q = n;
+				break;
+			case Insert:	/* undoes deletions */
+				if(u->p0+u->n == top->p0)
+					q = n-top->n;
+				else if(u->p0 == top->p0)
+					q = n;
+				break;
+			}
+		if(q!=~0 || top->seq==u->seq)
+			goto Out;
+	}
+	if(delta == &f->delta){
+		if(f->nundop == f->mundop){
+			f->mundop = 2*f->mundop+16;
+			f->undop = erealloc(f->undop, f->mundop*sizeof(uint));
+		}
+		f->undop[f->nundop++] = delta->nc;
+		undotrim(f);
+	}
+    Out:
+	if(delta == &f->delta){
+		f->jointop = 0;
+		if(u->seq == f->joinseq)
+			f->jointop = u->seq;
+	}
+	return q;
+}
+
+/*
+ * Replace the record on top of delta by u.
+ */
+static void
+undowiden(Buffer *delta, Undo *u)
+{
+	bufdelete(delta, delta->nc-Undosize, delta->nc);
+	bufinsert(delta, delta->nc, (Rune*)u, Undosize);
+}
+
 File*
 fileaddtext(File *f, Text *t)
 {
+	int n;
+
 	if(f == nil){
 		f = emalloc(sizeof(File));
 		f->unread = TRUE;
+		f->undomax = envint("undochanges", 0);
+		n = envint("undomem", Undomem);
+		if(n < 0)
+			n = 0;
+		if(n > 4095)	/* megabytes that fit in a uint of bytes */
+			n = 4095;
+		f->undomem = (uint)n*1024*1024;
 	}
 	f->text = realloc(f->text, (f->ntext+1)*sizeof(Text*));
 	f->text[f->ntext++] = t;
@@ -85,7 +206,7 @@ fileinsert(File *f, uint p0, Rune *s, uint ns)
 void
 fileuninsert(File *f, Buffer *delta, uint p0, uint ns)
 {
-	Undo u;
+	Undo u, t;
 
 	/* undo an insertion by deleting */
 	u.type = Delete;
@@ -93,6 +214,12 @@ fileuninsert(File *f, Buffer *delta, uint p0, uint ns)
 	u.seq = f->seq;
 	u.p0 = p0;
 	u.n = ns;
+	if(undojoin(f, delta, &u, &t) != ~0){
+		t.seq = u.seq;
+		t.n += ns;
+		undowiden(delta, &t);
+		return;
+	}
 	bufinsert(delta, delta->nc, (Rune*)&u, Undosize);
 }
 
@@ -111,9 +238,9 @@ filedelete(File *f, uint p0, uint p1)
 void
 fileundelete(File *f, Buffer *delta, uint p0, uint p1)
 {
-	Undo u;
+	Undo u, t;
 	Rune *buf;
-	uint i, n;
+	uint i, n, q;
 
 	/* undo a deletion by inserting */
 	u.type = Insert;
@@ -121,17 +248,28 @@ fileundelete(File *f, Buffer *delta, uint p0, uint p1)
 	u.seq = f->seq;
 	u.p0 = p0;
 	u.n = p1-p0;
+	q = undojoin(f, delta, &u, &t);
 	buf = fbufalloc();
 	for(i=p0; i<p1; i+=n){
 		n = p1 - i;
 		if(n > RBUFSIZE)
 			n = RBUFSIZE;
 		bufread(&f->b, i, buf, n);
-		bufinsert(delta, delta->nc, buf, n);
+		if(q == ~0)
+			bufinsert(delta, delta->nc, buf, n);
+		else
+			bufinsert(delta, q+(i-p0), buf, n);
 	}
 	fbuffree(buf);
+	if(q != ~0){
+		if(p0 < t.p0)
+			t.p0 = p0;
+		t.seq = u.seq;
+		t.n += u.n;
+		undowiden(delta, &t);
+		return;
+	}
 	bufinsert(delta, delta->nc, (Rune*)&u, Undosize);
-
 }
 
 void
@@ -149,7 +287,7 @@ filesetname(File *f, Rune *name, int n)
 void
 fileunsetname(File *f, Buffer *delta)
 {
-	Undo u;
+	Undo u, t;
 
 	/* undo a file name change by restoring old name */
 	u.type = Filename;
@@ -157,6 +295,7 @@ fileunsetname(File *f, Buffer *delta)
 	u.seq = f->seq;
 	u.p0 = 0;	/* unused */
 	u.n = f->nname;
+	undojoin(f, delta, &u, &t);
 	if(f->nname)
 		bufinsert(delta, delta->nc, f->name, f->nname);
 	bufinsert(delta, delta->nc, (Rune*)&u, Undosize);
@@ -274,6 +413,9 @@ fileundo(File *f, int isundo, uint *q0p, uint *q1p)
 	if(isundo)
 		f->seq = 0;
     Return:
+	while(f->nundop>0 && f->undop[f->nundop-1]>=f->delta.nc)
+		f->nundop--;
+	f->jointop = 0;
 	fbuffree(buf);
 }
 
@@ -282,9 +424,23 @@ filereset(File *f)
 {
 	bufreset(&f->delta);
 	bufreset(&f->epsilon);
+	f->nundop = 0;
+	f->jointop = 0;
 	f->seq = 0;
 }
 
+/*
+ * Set how many changes, and bytes of them, the file keeps to undo;
+ * 0 is no limit.
+ */
+void
+filebudget(File *f, int nchange, uint nbyte)
+{
+	f->undomax = nchange;
+	f->undomem = nbyte;
+	undotrim(f);
+}
+
 void
 fileclose(File *f)
 {
@@ -297,6 +453,7 @@ fileclose(File *f)
 	bufclose(&f->b);
 	bufclose(&f->delta);
 	bufclose(&f->epsilon);
+	free(f->undop);
 	elogclose(f);
 	free(f);
 }
@@ -20,6 +20,7 @@ void    updatelabel();
 void    getxselarg(Text*);
 void	putxsel(Text*);
 int	tempfile(void);
+int	envint(char*, int);
 void	scrlresize(void);
 Font*	getfont(int, int, char*);
 char*	getarg(Text*, int, int, Rune**, int*);
@@ -36,15 +37,18 @@ uint loadfile(int, uint, int*, int(*)(void*, uint, Rune*, int), void*);
 Window*	errorwin(Mntdir*, int);
 Window*	errorwinforwin(Window*);
 Runestr cleanrname(Runestr);
-void	run(Window*, char*, Rune*, int, int, char*, char*, int);
+void	run(Window*, char*, Rune*, int, int, char*, char*, int, int*);
 void fsysclose(void);
 void	setcurtext(Text*, int);
 int	isfilec(Rune);
-void	rxinit(void);
-int rxnull(void);
+Regexp*	rxlast(void);
+void	rxfree(Regexp*);
+char*	rxstats(char*, char*);
 Runestr	dirname(Text*, Rune*, int);
 void	error(char*);
 void	cvttorunes(char*, int, Rune*, int*, int*, int*);
+int	cvttobytes(Rune*, int, char*);
+int	asciispan(char*, int);
 void*	tmalloc(uint);
 void	tfree(void);
 void	killprocs(void);
@@ -80,7 +84,7 @@ Mntdir*	fsysmount(Rune*, int, Rune**, int);
 void		fsysdelid(Mntdir*);
 void		fsysincid(Mntdir*);
 Xfid*		respond(Xfid*, Fcall*, char*);
-int		rxcompile(Rune*);
+Regexp*	rxcompile(Rune*);
 int		rgetc(void*, uint);
 int		tgetc(void*, uint);
 int		isaddrc(int);
@@ -89,8 +93,9 @@ void *emalloc(uint);
 void *erealloc(void*, uint);
 char	*estrdup(char*);
 Range		address(uint, Text*, Range, Range, void*, uint, uint, int (*)(void*, uint),  int*, uint*);
-int		rxexecute(Text*, Rune*, uint, uint, Rangeset*);
-int		rxbexecute(Text*, uint, Rangeset*);
+int		rxexecute(Regexp*, Text*, Rune*, uint, uint, Rangeset*);
+int		rxbexecute(Regexp*, Text*, uint, Rangeset*);
+Range*	rxmatches(Regexp*, Text*, uint, uint, int, int*);
 Window*	makenewwindow(Text *t);
 int	expand(Text*, uint, uint, Expand*);
 Rune*	skipbl(Rune*, int, int*);
@@ -72,6 +72,7 @@ Dirtab dirtab[]=
 	{ "index",		QTFILE,	Qindex,	0400 },
 	{ "label",		QTFILE,	Qlabel,	0600 },
 	{ "new",		QTDIR,	Qnew,	0500|DMDIR },
+	{ "stats",		QTFILE,	Qstats,	0400 },
 	{ nil, }
 };
 
@@ -85,6 +86,7 @@ Dirtab dirtabw[]=
 	{ "editout",	QTFILE,		QWeditout,	0200 },
 	{ "errors",		QTFILE,		QWerrors,		0200 },
 	{ "event",		QTFILE,		QWevent,		0600 },
+	{ "matches",	QTFILE,		QWmatches,	0600 },
 	{ "rdsel",		QTFILE,		QWrdsel,		0400 },
 	{ "wrsel",		QTFILE,		QWwrsel,		0200 },
 	{ "tag",		QTAPPEND,	QWtag,		0600|DMAPPEND },
@@ -300,77 +300,81 @@ plumbshow(Plumbmsg *m)
 	drawtopwindow();
 }
 
+/*
+ * Look for the n runes of r starting from p to e, ending by the end
+ * of b, by Horspool's method over the blocks of b.  A rune's shift
+ * is the one for its low byte, the smallest of the runes sharing it.
+ * A candidate that starts in an earlier block is checked through t.
+ */
+static int
+bufsearch(Buffer *b, uint p, uint e, Rune *r, uint n, uint *shift, Rune *t, uint *qp)
+{
+	Rune *s;
+	Rune c;
+	uint q, h, s0, s1;
+
+	if(e > b->nc-n+1)
+		e = b->nc-n+1;
+	/* q is the last rune of the window */
+	for(q=p+n-1; q<e+n-1; ){
+		s = bufspan(b, q, &s0, &s1);
+		h = min(s1, e+n-1);
+		while(q < h){
+			c = s[q-s0];
+			if(c == r[n-1]){
+				if(q-n+1 >= s0){
+					if(runeeq(s+(q-n+1-s0), n-1, r, n-1)){
+						*qp = q-n+1;
+						return TRUE;
+					}
+				}else{
+					bufread(b, q-n+1, t, n-1);
+					if(runeeq(t, n-1, r, n-1)){
+						*qp = q-n+1;
+						return TRUE;
+					}
+					q += shift[c&0xFF];
+					break;	/* the block is gone */
+				}
+			}
+			q += shift[c&0xFF];
+		}
+	}
+	return FALSE;
+}
+
 int
 search(Text *ct, Rune *r, uint n)
 {
-	uint q, nb, maxn;
-	int around;
-	Rune *s, *b, *c;
+	uint i, q, shift[256];
+	Rune *t;
+	Buffer *b;
+	int found;
 
-	if(n==0 || n>ct->file->b.nc)
+	b = &ct->file->b;
+	if(n==0 || n>b->nc)
 		return FALSE;
-	if(2*n > RBUFSIZE){
-		warning(nil, "string too long\n");
+	for(i=0; i<nelem(shift); i++)
+		shift[i] = n;
+	for(i=0; i<n-1; i++)
+		shift[r[i]&0xFF] = n-1-i;
+	t = runemalloc(n);
+	/* from the end of the selection on, then around from the top */
+	found = bufsearch(b, ct->q1, b->nc, r, n, shift, t, &q);
+	if(!found)
+		found = bufsearch(b, 0, ct->q1, r, n, shift, t, &q);
+	free(t);
+	if(!found)
 		return FALSE;
+	if(ct->w){
+		textshow(ct, q, q+n, 1);
+		winsettag(ct->w);
+	}else{
+		ct->q0 = q;
+		ct->q1 = q+n;
 	}
-	maxn = max(2*n, RBUFSIZE);
-	s = fbufalloc();
-	b = s;
-	nb = 0;
-	b[nb] = 0;
-	around = 0;
-	q = ct->q1;
-	for(;;){
-		if(q >= ct->file->b.nc){
-			q = 0;
-			around = 1;
-			nb = 0;
-			b[nb] = 0;
-		}
-		if(nb > 0){
-			c = runestrchr(b, r[0]);
-			if(c == nil){
-				q += nb;
-				nb = 0;
-				b[nb] = 0;
-				if(around && q>=ct->q1)
-					break;
-				continue;
-			}
-			q += (c-b);
-			nb -= (c-b);
-			b = c;
-		}
-		/* reload if buffer covers neither string nor rest of file */
-		if(nb<n && nb!=ct->file->b.nc-q){
-			nb = ct->file->b.nc-q;
-			if(nb >= maxn)
-				nb = maxn-1;
-			bufread(&ct->file->b, q, s, nb);
-			b = s;
-			b[nb] = '\0';
-		}
-		/* this runeeq is fishy but the null at b[nb] makes it safe */
-		if(runeeq(b, n, r, n)==TRUE){
-			if(ct->w){
-				textshow(ct, q, q+n, 1);
-				winsettag(ct->w);
-			}else{
-				ct->q0 = q;
-				ct->q1 = q+n;
-			}
-			seltext = ct;
-			fbuffree(s);
-			return TRUE;
-		}
-		--nb;
-		b++;
-		q++;
-		if(around && q>=ct->q1)
-			break;
-	}
-	fbuffree(s);
-	return FALSE;
+	seltext = ct;
+	return TRUE;
 }
 
 int
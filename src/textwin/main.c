@@ -20,6 +20,7 @@ void	waitthread(void*);
 void	xfidallocthread(void*);
 void	newwindowthread(void*);
 void	selchangethread(void*);
+void	compactthread(void*);
 void	plumbproc(void*);
 int	timefmt(Fmt*);
 
@@ -212,7 +213,6 @@ threadmain(int argc, char *argv[])
 
 	iconinit();
 	timerinit();
-	rxinit();
 
 	cwait = threadwaitchan();
 	ccommand = chancreate(sizeof(Command**), 0);
@@ -310,6 +310,7 @@ threadmain(int argc, char *argv[])
 	threadcreate(newwindowthread, nil, STACK);
 /*	threadcreate(shutdownthread, nil, STACK); */
 	threadcreate(selchangethread, nil, STACK);
+	threadcreate(compactthread, nil, STACK);
 	threadnotify(shutdown, 1);
 	recvul(cexit);
 	killprocs();
@@ -941,6 +942,25 @@ selchangethread(void* v)
 	}
 }
 
+/* this thread, in the main proc, squeezes dead space out of the temp file now and then */
+void
+compactthread(void *v)
+{
+	Timer *t;
+
+	USED(v);
+	threadsetname("compactthread");
+
+	for(;;){
+		t = timerstart(5000);
+		recvul(t->c);
+		timerstop(t);
+		qlock(&row.lk);
+		diskcompact(disk, FALSE);
+		qunlock(&row.lk);
+	}
+}
+
 Reffont*
 rfget(int fix, int save, int setfont, char *name)
 {
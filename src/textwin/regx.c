@@ -11,9 +11,6 @@
 #include "dat.h"
 #include "fns.h"
 
-Rangeset	sel;
-Rune		*lastregexp;
-
 /*
  * Machine Information
  */
@@ -35,11 +32,6 @@ struct Inst
 };
 
 #define	NPROG	1024
-Inst	program[NPROG];
-Inst	*progp;
-Inst	*startinst;	/* First inst. of program; might not be program[0] */
-Inst	*bstartinst;	/* same for backwards machine */
-Channel	*rechan;	/* chan(Inst*) */
 
 typedef struct Ilist Ilist;
 struct Ilist
@@ -49,11 +41,254 @@ struct Ilist
 	uint	startp;		/* first char of match */
 };
 
-#define	NLIST	127
+/*
+ * A list of threads, grown as needed.  An instruction's latest entry
+ * is found through where[], which is valid when gen[] matches the
+ * list's generation; clearing the list just starts a new generation.
+ */
+typedef struct Tlist Tlist;
+struct Tlist
+{
+	Ilist	*t;
+	int	n;
+	int	nalloc;
+	Inst	*program;	/* where[] and gen[] are indexed from here */
+	int	nprog;
+	int	*where;
+	uint	*gen;
+	uint	g;
+};
+
+/*
+ * Lazy DFA.
+ *
+ * A state is the set of instructions the NFA would have pending at
+ * some position, grouped by where their threads started, earliest
+ * first, with Mark between the groups.  An instruction belongs to the
+ * earliest group that reaches it, as addinst keeps the earliest start,
+ * and once a group reaches END the later ones are dropped and no new
+ * threads start.  So the last match seen while scanning is where the
+ * leftmost-longest match ends, and running the other machine back from
+ * there, anchored, finds where it starts.  States are made as they are
+ * needed and kept in the context of the search that made them.
+ *
+ * That yields only r[0]; subexpressions come from running the NFA over
+ * the match, and the NFA does the whole search if the states outgrow
+ * Dmem.  Runes are mapped to classes that every instruction treats
+ * alike, so a state has one transition per class.
+ */
+enum
+{
+	Mark		= -1,
+	Fctx		= 1,	/* ^ (forwards) or $ (backwards) holds here */
+	Fnostart	= 2,	/* no new threads */
+	Ndhash	= 1024,
+	Dmem		= 4*1024*1024,	/* bytes of states per machine */
+	Nlit		= 32,
+	Nrxcache	= 16,	/* compiled expressions kept */
+	Searchchunk	= 256*1024,	/* runes in which a searchproc looks for matches to start */
+	Searchwin	= 16*1024,	/* and how far past them it reads to see them end */
+	Parsearch	= 4,	/* default size, megarunes, for searching in parallel */
+};
+
+/*
+ * A literal to look for, with a Horspool shift for the low byte of
+ * each rune; runes sharing a low byte get the smallest shift.
+ */
+typedef struct Lit Lit;
+struct Lit
+{
+	Rune	r[Nlit];
+	int	n;
+	uchar	shift[256];
+};
+
+typedef struct Dstate Dstate;
+struct Dstate
+{
+	int	flag;
+	int	ninst;
+	int	*inst;		/* indices into program, groups separated by Mark */
+	Dstate	**next;		/* by class; nil until needed */
+	uchar	*match;		/* END reached on the way to next[i] */
+	Dstate	*nostart;	/* this state with Fnostart set */
+	Dstate	*hnext;
+};
 
-Ilist	*tl, *nl;	/* This list, next list */
-Ilist	list[2][NLIST+1];	/* +1 for trailing null */
-static	Rangeset sempty;
+/*
+ * What is known of a machine when it is compiled.
+ */
+typedef struct Mach Mach;
+struct Mach
+{
+	Inst	*start;
+	int	back;		/* runs from right to left */
+	int	skip;		/* first and firsthi say where a match can begin */
+	uchar	first[Runeself/8];
+	int	firsthi;	/* as can any rune >= Runeself */
+	Lit	lit;		/* every match begins with this (forwards) */
+};
+
+typedef struct Dfa Dfa;
+struct Dfa
+{
+	Mach	*m;
+	int	failed;		/* ran out of room; use the NFA */
+	long	mem;
+	Dstate	*hash[Ndhash];
+};
+
+/*
+ * A [] class: its runes as sorted, disjoint ranges, pairs lo, hi,
+ * searched for runes past ASCII, which the bitmap covers.  A negated
+ * class holds the runes it does not match.
+ */
+typedef struct Class Class;
+struct Class
+{
+	uchar	map[Runeself/8];
+	Rune	*r;
+	int	nr;		/* ranges */
+};
+
+typedef struct Rxctx Rxctx;
+
+/*
+ * A compiled expression.  Nothing in it changes once it is built,
+ * so any number of searches may share it; what a search changes is
+ * kept in a context of its own, taken from free and put back after,
+ * so the DFA states it builds are there for the next search.
+ */
+struct Regexp
+{
+	Rune	*pat;
+	int	npat;		/* including NUL */
+	int	ref;		/* under rxlk */
+	Inst	*program;	/* NPROG of them */
+	Inst	*progp;
+	Inst	*startinst;	/* First inst. of program; might not be program[0] */
+	Inst	*bstartinst;	/* same for backwards machine */
+	Inst	*bprogram;	/* backwards machine starts here in program */
+	int	nsubexp;	/* parenthesized subexpressions in program */
+	Class	*class;
+	int	nclass;
+	Rune	*cbound;	/* first rune of each class */
+	int	ncbound;
+	ushort	cascii[Runeself];	/* class of each ASCII rune */
+	Mach	fmach;
+	Mach	bmach;
+	Lit	req;		/* every match contains this */
+	QLock	lk;
+	Rxctx	*free;
+};
+
+struct Rxctx
+{
+	Regexp	*re;
+	Rangeset	sel;
+	Tlist	list[2];
+	Dfa	fdfa;
+	Dfa	bdfa;
+	int	*dinst;		/* state being built */
+	int	ndinst;
+	int	*dstack;
+	uint	*dseen;		/* reached in this step, by generation */
+	uint	*dnseen;	/* in dinst, by generation */
+	uint	dgen;
+	Rxctx	*next;
+};
+
+/*
+ * The text being searched, seen through s, which holds the runes
+ * from q0 to q1: the block of the buffer holding the last rune asked
+ * for, all of a string, or a single rune while typing is cached.
+ */
+typedef struct Span Span;
+struct Span
+{
+	Text	*t;
+	Rune	*r;
+	long	nc;
+	Rune	*s;
+	long	q0;
+	long	q1;
+	Rune	one;
+};
+
+/*
+ * What a searchproc found: the first match starting from p to the
+ * end of its chunk, or none if q0 < 0.
+ */
+typedef struct Rxfound Rxfound;
+struct Rxfound
+{
+	long	p;
+	long	q0;
+	long	q1;
+};
+
+/*
+ * A piece of a big search, for a searchproc: the runes from off to
+ * off+n, which end the text unless more, of which matches starting
+ * from lo to hi are wanted.  It finds the first, or, if all, the
+ * first from each place an x command would look next, and stops
+ * early if a match might run on past the runes it has.
+ */
+typedef struct Rxchunk Rxchunk;
+struct Rxchunk
+{
+	Regexp	*re;
+	Rune	*r;
+	long	off;
+	long	n;
+	long	lo;
+	long	hi;
+	int	more;
+	int	all;
+	int	cancel;
+	Rxfound	*f;
+	int	nf;
+	int	nfalloc;
+	Channel	*done;	/* chan(Rxchunk*)[1]; returned here when searched */
+};
+
+/*
+ * A search for matches starting from lo to hi in text ending at end.
+ * A big one is cut into chunks, sent to the searchprocs ahead of
+ * where the answers are wanted and read back in order; where a chunk
+ * has no answer the search is done here.
+ */
+typedef struct Rxscan Rxscan;
+struct Rxscan
+{
+	Rxctx	*x;
+	Text	*t;
+	long	lo;
+	long	hi;
+	long	end;
+	Rxchunk	*c;		/* ring of nc, nil if not cut up */
+	int	nc;
+	int	head;		/* chunk answers come from */
+	int	nin;		/* sent and not finished with */
+	int	got;		/* head has come back */
+	int	k;		/* its answer to look at next */
+	long	next;		/* where the next chunk to send starts */
+};
+
+/*
+ * Compiled expressions by pattern, most recently used first; each
+ * holds a reference.  The first is the one an empty pattern means,
+ * unless the last pattern asked for would not compile.
+ */
+QLock	rxlk;
+Regexp	*rxcache[Nrxcache];
+static	Channel	*csearch;	/* chan(Rxchunk*); work for the searchprocs */
+static	int	nsearchproc;
+static	long	parsearch;
+int	nrxcache;
+int	rxlastbad;
+ulong	rxhits;
+ulong	rxmisses;
 
 /*
  * Actions and Tokens
@@ -92,279 +327,488 @@ struct Node
 };
 
 #define	NSTACK	20
-Node	andstack[NSTACK];
-Node	*andp;
-int	atorstack[NSTACK];
-int	*atorp;
-int	lastwasand;	/* Last token was operand */
-int	cursubid;
-int	subidstack[NSTACK];
-int	*subidp;
-int	backwards;
-int	nbra;
-Rune	*exprp;		/* pointer to next character in source expression */
 #define	DCLASS	10	/* allocation increment */
-int	nclass;		/* number active */
-int	Nclass;		/* high water mark */
-Rune	**class;
-int	negateclass;
-
-int	addinst(Ilist *l, Inst *inst, Rangeset *sep);
-void	newmatch(Rangeset*);
-void	bnewmatch(Rangeset*);
-void	pushand(Inst*, Inst*);
-void	pushator(int);
-Node	*popand(int);
-int	popator(void);
-void	startlex(Rune*);
-int	lex(void);
-void	operator(int);
-void	operand(int);
-void	evaluntil(int);
-void	optimize(Inst*);
-void	bldcclass(void);
 
-void
-rxinit(void)
+/*
+ * One compilation.  The parser runs in a thread of its own, which
+ * sends the first instruction on c, or nil after an error.
+ */
+typedef struct Comp Comp;
+struct Comp
 {
-	rechan = chancreate(sizeof(Inst*), 0);
-	chansetname(rechan, "rechan");
-	lastregexp = runemalloc(1);
-}
+	Regexp	*re;
+	Channel	*c;	/* chan(Inst*) */
+	Rune	*pat;
+	Node	andstack[NSTACK];
+	Node	*andp;
+	int	atorstack[NSTACK];
+	int	*atorp;
+	int	lastwasand;	/* Last token was operand */
+	int	cursubid;
+	int	subidstack[NSTACK];
+	int	*subidp;
+	int	backwards;
+	int	nbra;
+	Rune	*exprp;		/* pointer to next character in source expression */
+	int	Nclass;		/* high water mark */
+	int	negateclass;
+};
+
+int	addinst(Tlist *l, int from, Inst *inst, Rangeset *sep);
+void	newmatch(Rxctx*, Rangeset*);
+void	bnewmatch(Rxctx*, Rangeset*);
+void	pushand(Comp*, Inst*, Inst*);
+void	pushator(Comp*, int);
+Node	*popand(Comp*, int);
+int	popator(Comp*);
+void	startlex(Comp*, Rune*);
+int	lex(Comp*);
+void	operator(Comp*, int);
+void	operand(Comp*, int);
+void	evaluntil(Comp*, int);
+void	optimize(Inst*);
+void	bldcclass(Comp*);
+int	classmatch(Regexp*, int, int, int);
+static	void	tlinit(Tlist*, Inst*, int);
+static	void	tlclear(Tlist*);
+static	Rxctx*	rxctx(Regexp*);
+static	void	rxdone(Rxctx*);
+static	void	dfafree(Dfa*);
+static	void	mkclass(Class*, Rune*, int);
+static	void	mkclasses(Regexp*);
+static	int	runecmp(const void*, const void*);
+static	void	mkmach(Rxctx*, Mach*, Inst*, int);
+static	void	mkreq(Rxctx*);
+static	void	mklit(Lit*);
+static	long	findlit(Span*, long, long, long, Lit*);
+static	void	spaninit(Span*, Text*, Rune*);
+static	Rune	spanc(Span*, long);
+static	Dstate*	dinit(Rxctx*, Dfa*, int, int);
+static	int	dexecute(Rxctx*, Text*, Rune*, uint, uint, Rangeset*);
+static	int	dbexecute(Rxctx*, Text*, uint, Rangeset*);
+static	int	nfaexecute(Rxctx*, Text*, Rune*, uint, uint, Rangeset*);
+static	int	nfabexecute(Rxctx*, Text*, uint, Rangeset*);
+static	int	pexecute(Rxctx*, Text*, uint, uint, Rangeset*);
+static	int	dosplit(Text*, long);
 
 void
-regerror(char *e)
+regerror(Comp *c, char *e)
 {
-	lastregexp[0] = 0;
 	warning(nil, "regexp: %s\n", e);
-	sendp(rechan, nil);
+	sendp(c->c, nil);
 	threadexits(nil);
 }
 
 Inst *
-newinst(int t)
+newinst(Comp *c, int t)
 {
-	if(progp >= &program[NPROG])
-		regerror("expression too long");
-	progp->type = t;
-	progp->u1.left = nil;
-	progp->u.right = nil;
-	return progp++;
+	Regexp *re;
+
+	re = c->re;
+	if(re->progp >= &re->program[NPROG])
+		regerror(c, "expression too long");
+	re->progp->type = t;
+	re->progp->u1.left = nil;
+	re->progp->u.right = nil;
+	return re->progp++;
 }
 
 void
 realcompile(void *arg)
 {
 	int token;
-	Rune *s;
+	Comp *c;
 
 	threadsetname("regcomp");
-	s = arg;
-	startlex(s);
-	atorp = atorstack;
-	andp = andstack;
-	subidp = subidstack;
-	cursubid = 0;
-	lastwasand = FALSE;
+	c = arg;
+	startlex(c, c->pat);
+	c->atorp = c->atorstack;
+	c->andp = c->andstack;
+	c->subidp = c->subidstack;
+	c->cursubid = 0;
+	c->lastwasand = FALSE;
 	/* Start with a low priority operator to prime parser */
-	pushator(START-1);
-	while((token=lex()) != END){
+	pushator(c, START-1);
+	while((token=lex(c)) != END){
 		if((token&ISATOR) == OPERATOR)
-			operator(token);
+			operator(c, token);
 		else
-			operand(token);
+			operand(c, token);
 	}
 	/* Close with a low priority operator */
-	evaluntil(START);
+	evaluntil(c, START);
 	/* Force END */
-	operand(END);
-	evaluntil(START);
-	if(nbra)
-		regerror("unmatched `('");
-	--andp;	/* points to first and only operand */
-	sendp(rechan, andp->first);
+	operand(c, END);
+	evaluntil(c, START);
+	if(c->nbra)
+		regerror(c, "unmatched `('");
+	--c->andp;	/* points to first and only operand */
+	sendp(c->c, c->andp->first);
 	threadexits(nil);
 }
 
-/* r is null terminated */
-int
+static void
+refree(Regexp *re)
+{
+	Rxctx *x;
+	int i;
+
+	while((x = re->free) != nil){
+		re->free = x->next;
+		for(i=0; i<2; i++){
+			free(x->list[i].t);
+			free(x->list[i].where);
+			free(x->list[i].gen);
+		}
+		dfafree(&x->fdfa);
+		dfafree(&x->bdfa);
+		free(x->dinst);
+		free(x->dstack);
+		free(x->dseen);
+		free(x->dnseen);
+		free(x);
+	}
+	for(i=0; i<re->nclass; i++)
+		free(re->class[i].r);
+	free(re->class);
+	free(re->cbound);
+	free(re->program);
+	free(re->pat);
+	free(re);
+}
+
+/*
+ * The cached expression for r, moved to the front, or nil.
+ * Called with rxlk held.
+ */
+static Regexp*
+rxlookup(Rune *r, int nr)
+{
+	Regexp *re;
+	int i;
+
+	for(i=0; i<nrxcache; i++){
+		re = rxcache[i];
+		if(runeeq(re->pat, re->npat, r, nr) == TRUE){
+			memmove(rxcache+1, rxcache, i*sizeof(Regexp*));
+			rxcache[0] = re;
+			return re;
+		}
+	}
+	return nil;
+}
+
+/*
+ * r is null terminated.  Returns nil, having said why, if it
+ * will not compile; a pattern compiled recently gets the same
+ * Regexp.  Let it go with rxfree.
+ */
+Regexp*
 rxcompile(Rune *r)
 {
-	int i, nr;
+	int nr;
 	Inst *oprogp;
+	Regexp *re, *old;
+	Comp c;
 
 	nr = runestrlen(r)+1;
-	if(runeeq(lastregexp, runestrlen(lastregexp)+1, r, nr)==TRUE)
-		return TRUE;
-	lastregexp[0] = 0;
-	for(i=0; i<nclass; i++)
-		free(class[i]);
-	nclass = 0;
-	progp = program;
-	backwards = FALSE;
-	bstartinst = nil;
-	threadcreate(realcompile, r, STACK);
-	startinst = recvp(rechan);
-	if(startinst == nil)
-		return FALSE;
-	optimize(program);
-	oprogp = progp;
-	backwards = TRUE;
-	threadcreate(realcompile, r, STACK);
-	bstartinst = recvp(rechan);
-	if(bstartinst == nil)
-		return FALSE;
+	qlock(&rxlk);
+	re = rxlookup(r, nr);
+	if(re != nil){
+		re->ref++;
+		rxhits++;
+		rxlastbad = FALSE;
+		qunlock(&rxlk);
+		return re;
+	}
+	rxmisses++;
+	qunlock(&rxlk);
+	re = emalloc(sizeof(Regexp));
+	re->program = emalloc(NPROG*sizeof(Inst));
+	re->progp = re->program;
+	memset(&c, 0, sizeof c);
+	c.re = re;
+	c.pat = r;
+	c.c = chancreate(sizeof(Inst*), 0);
+	chansetname(c.c, "rechan");
+	c.backwards = FALSE;
+	threadcreate(realcompile, &c, STACK);
+	re->startinst = recvp(c.c);
+	oprogp = nil;
+	if(re->startinst != nil){
+		optimize(re->program);
+		re->nsubexp = c.cursubid;
+		oprogp = re->progp;
+		c.backwards = TRUE;
+		threadcreate(realcompile, &c, STACK);
+		re->bstartinst = recvp(c.c);
+	}
+	chanfree(c.c);
+	if(re->bstartinst == nil){
+		refree(re);
+		qlock(&rxlk);
+		rxlastbad = TRUE;
+		qunlock(&rxlk);
+		return nil;
+	}
 	optimize(oprogp);
-	lastregexp = runerealloc(lastregexp, nr);
-	runemove(lastregexp, r, nr);
-	return TRUE;
+	re->bprogram = oprogp;
+	re->pat = runemalloc(nr);
+	re->npat = nr;
+	runemove(re->pat, r, nr);
+	mkclasses(re);
+	re->free = rxctx(re);
+	mkmach(re->free, &re->fmach, re->startinst, FALSE);
+	mkmach(re->free, &re->bmach, re->bstartinst, TRUE);
+	mkreq(re->free);
+	qlock(&rxlk);
+	rxlastbad = FALSE;
+	old = rxlookup(r, nr);
+	if(old != nil){
+		/* compiled meanwhile by another search */
+		old->ref++;
+		qunlock(&rxlk);
+		refree(re);
+		return old;
+	}
+	if(nrxcache == Nrxcache)
+		old = rxcache[--nrxcache];
+	memmove(rxcache+1, rxcache, nrxcache*sizeof(Regexp*));
+	rxcache[0] = re;
+	nrxcache++;
+	re->ref = 2;
+	qunlock(&rxlk);
+	if(old != nil)
+		rxfree(old);
+	return re;
+}
+
+/*
+ * The expression last compiled, or nil if the last one failed.
+ */
+Regexp*
+rxlast(void)
+{
+	Regexp *re;
+
+	qlock(&rxlk);
+	re = nil;
+	if(nrxcache>0 && !rxlastbad){
+		re = rxcache[0];
+		re->ref++;
+	}
+	qunlock(&rxlk);
+	return re;
+}
+
+char*
+rxstats(char *p, char *e)
+{
+	qlock(&rxlk);
+	p = seprint(p, e, "regexp cache %d hits %lud misses %lud\n", nrxcache, rxhits, rxmisses);
+	qunlock(&rxlk);
+	return p;
 }
 
 void
-operand(int t)
+rxfree(Regexp *re)
+{
+	int n;
+
+	qlock(&rxlk);
+	n = --re->ref;
+	qunlock(&rxlk);
+	if(n == 0)
+		refree(re);
+}
+
+/*
+ * A context for a search with re, from its free list if one is there.
+ */
+static Rxctx*
+rxctx(Regexp *re)
+{
+	Rxctx *x;
+	int n;
+
+	qlock(&re->lk);
+	x = re->free;
+	if(x != nil)
+		re->free = x->next;
+	qunlock(&re->lk);
+	if(x != nil)
+		return x;
+	n = re->progp-re->program;
+	x = emalloc(sizeof(Rxctx));
+	x->re = re;
+	tlinit(&x->list[0], re->program, n);
+	tlinit(&x->list[1], re->program, n);
+	x->fdfa.m = &re->fmach;
+	x->bdfa.m = &re->bmach;
+	x->dinst = emalloc(2*n*sizeof(int));
+	x->dstack = emalloc(n*sizeof(int));
+	x->dseen = emalloc(n*sizeof(uint));
+	x->dnseen = emalloc(n*sizeof(uint));
+	return x;
+}
+
+static void
+rxdone(Rxctx *x)
+{
+	Regexp *re;
+
+	re = x->re;
+	qlock(&re->lk);
+	x->next = re->free;
+	re->free = x;
+	qunlock(&re->lk);
+}
+
+void
+operand(Comp *c, int t)
 {
 	Inst *i;
-	if(lastwasand)
-		operator(CAT);	/* catenate is implicit */
-	i = newinst(t);
+	if(c->lastwasand)
+		operator(c, CAT);	/* catenate is implicit */
+	i = newinst(c, t);
 	if(t == CCLASS){
-		if(negateclass)
+		if(c->negateclass)
 			i->type = NCCLASS;	/* UGH */
-		i->u.class = nclass-1;		/* UGH */
+		i->u.class = c->re->nclass-1;		/* UGH */
 	}
-	pushand(i, i);
-	lastwasand = TRUE;
+	pushand(c, i, i);
+	c->lastwasand = TRUE;
 }
 
 void
-operator(int t)
+operator(Comp *c, int t)
 {
-	if(t==RBRA && --nbra<0)
-		regerror("unmatched `)'");
+	if(t==RBRA && --c->nbra<0)
+		regerror(c, "unmatched `)'");
 	if(t==LBRA){
-		cursubid++;	/* silently ignored */
-		nbra++;
-		if(lastwasand)
-			operator(CAT);
+		c->cursubid++;	/* silently ignored */
+		c->nbra++;
+		if(c->lastwasand)
+			operator(c, CAT);
 	}else
-		evaluntil(t);
+		evaluntil(c, t);
 	if(t!=RBRA)
-		pushator(t);
-	lastwasand = FALSE;
+		pushator(c, t);
+	c->lastwasand = FALSE;
 	if(t==STAR || t==QUEST || t==PLUS || t==RBRA)
-		lastwasand = TRUE;	/* these look like operands */
+		c->lastwasand = TRUE;	/* these look like operands */
 }
 
 void
-pushand(Inst *f, Inst *l)
+pushand(Comp *c, Inst *f, Inst *l)
 {
-	if(andp >= &andstack[NSTACK])
+	if(c->andp >= &c->andstack[NSTACK])
 		error("operand stack overflow");
-	andp->first = f;
-	andp->last = l;
-	andp++;
+	c->andp->first = f;
+	c->andp->last = l;
+	c->andp++;
 }
 
 void
-pushator(int t)
+pushator(Comp *c, int t)
 {
-	if(atorp >= &atorstack[NSTACK])
+	if(c->atorp >= &c->atorstack[NSTACK])
 		error("operator stack overflow");
-	*atorp++=t;
-	if(cursubid >= NRange)
-		*subidp++= -1;
+	*c->atorp++=t;
+	if(c->cursubid >= NRange)
+		*c->subidp++= -1;
 	else
-		*subidp++=cursubid;
+		*c->subidp++=c->cursubid;
 }
 
 Node *
-popand(int op)
+popand(Comp *c, int op)
 {
 	char buf[64];
 
-	if(andp <= &andstack[0])
+	if(c->andp <= &c->andstack[0])
 		if(op){
 			sprint(buf, "missing operand for %c", op);
-			regerror(buf);
+			regerror(c, buf);
 		}else
-			regerror("malformed regexp");
-	return --andp;
+			regerror(c, "malformed regexp");
+	return --c->andp;
 }
 
 int
-popator()
+popator(Comp *c)
 {
-	if(atorp <= &atorstack[0])
+	if(c->atorp <= &c->atorstack[0])
 		error("operator stack underflow");
-	--subidp;
-	return *--atorp;
+	--c->subidp;
+	return *--c->atorp;
 }
 
 void
-evaluntil(int pri)
+evaluntil(Comp *c, int pri)
 {
 	Node *op1, *op2, *t;
 	Inst *inst1, *inst2;
 
-	while(pri==RBRA || atorp[-1]>=pri){
-		switch(popator()){
+	while(pri==RBRA || c->atorp[-1]>=pri){
+		switch(popator(c)){
 		case LBRA:
-			op1 = popand('(');
-			inst2 = newinst(RBRA);
-			inst2->u.subid = *subidp;
+			op1 = popand(c, '(');
+			inst2 = newinst(c, RBRA);
+			inst2->u.subid = *c->subidp;
 			op1->last->u1.next = inst2;
-			inst1 = newinst(LBRA);
-			inst1->u.subid = *subidp;
+			inst1 = newinst(c, LBRA);
+			inst1->u.subid = *c->subidp;
 			inst1->u1.next = op1->first;
-			pushand(inst1, inst2);
+			pushand(c, inst1, inst2);
 			return;		/* must have been RBRA */
 		default:
 			error("unknown regexp operator");
 			break;
 		case OR:
-			op2 = popand('|');
-			op1 = popand('|');
-			inst2 = newinst(NOP);
+			op2 = popand(c, '|');
+			op1 = popand(c, '|');
+			inst2 = newinst(c, NOP);
 			op2->last->u1.next = inst2;
 			op1->last->u1.next = inst2;
-			inst1 = newinst(OR);
+			inst1 = newinst(c, OR);
 			inst1->u.right = op1->first;
 			inst1->u1.left = op2->first;
-			pushand(inst1, inst2);
+			pushand(c, inst1, inst2);
 			break;
 		case CAT:
-			op2 = popand(0);
-			op1 = popand(0);
-			if(backwards && op2->first->type!=END){
+			op2 = popand(c, 0);
+			op1 = popand(c, 0);
+			if(c->backwards && op2->first->type!=END){
 				t = op1;
 				op1 = op2;
 				op2 = t;
 			}
 			op1->last->u1.next = op2->first;
-			pushand(op1->first, op2->last);
+			pushand(c, op1->first, op2->last);
 			break;
 		case STAR:
-			op2 = popand('*');
-			inst1 = newinst(OR);
+			op2 = popand(c, '*');
+			inst1 = newinst(c, OR);
 			op2->last->u1.next = inst1;
 			inst1->u.right = op2->first;
-			pushand(inst1, inst1);
+			pushand(c, inst1, inst1);
 			break;
 		case PLUS:
-			op2 = popand('+');
-			inst1 = newinst(OR);
+			op2 = popand(c, '+');
+			inst1 = newinst(c, OR);
 			op2->last->u1.next = inst1;
 			inst1->u.right = op2->first;
-			pushand(op2->first, inst1);
+			pushand(c, op2->first, inst1);
 			break;
 		case QUEST:
-			op2 = popand('?');
-			inst1 = newinst(OR);
-			inst2 = newinst(NOP);
+			op2 = popand(c, '?');
+			inst1 = newinst(c, OR);
+			inst2 = newinst(c, NOP);
 			inst1->u1.left = inst2;
 			inst1->u.right = op2->first;
 			op2->last->u1.next = inst2;
-			pushand(inst1, inst2);
+			pushand(c, inst1, inst2);
 			break;
 		}
 	}
@@ -385,196 +829,289 @@ optimize(Inst *start)
 }
 
 void
-startlex(Rune *s)
+startlex(Comp *c, Rune *s)
 {
-	exprp = s;
-	nbra = 0;
+	c->exprp = s;
+	c->nbra = 0;
 }
 
 
 int
-lex(void){
-	int c;
+lex(Comp *c){
+	int t;
 
-	c = *exprp++;
-	switch(c){
+	t = *c->exprp++;
+	switch(t){
 	case '\\':
-		if(*exprp)
-			if((c= *exprp++)=='n')
-				c='\n';
+		if(*c->exprp)
+			if((t= *c->exprp++)=='n')
+				t='\n';
 		break;
 	case 0:
-		c = END;
-		--exprp;	/* In case we come here again */
+		t = END;
+		--c->exprp;	/* In case we come here again */
 		break;
 	case '*':
-		c = STAR;
+		t = STAR;
 		break;
 	case '?':
-		c = QUEST;
+		t = QUEST;
 		break;
 	case '+':
-		c = PLUS;
+		t = PLUS;
 		break;
 	case '|':
-		c = OR;
+		t = OR;
 		break;
 	case '.':
-		c = ANY;
+		t = ANY;
 		break;
 	case '(':
-		c = LBRA;
+		t = LBRA;
 		break;
 	case ')':
-		c = RBRA;
+		t = RBRA;
 		break;
 	case '^':
-		c = BOL;
+		t = BOL;
 		break;
 	case '$':
-		c = EOL;
+		t = EOL;
 		break;
 	case '[':
-		c = CCLASS;
-		bldcclass();
+		t = CCLASS;
+		bldcclass(c);
 		break;
 	}
-	return c;
+	return t;
 }
 
 int
-nextrec(void)
-{
-	if(exprp[0]==0 || (exprp[0]=='\\' && exprp[1]==0))
-		regerror("malformed `[]'");
-	if(exprp[0] == '\\'){
-		exprp++;
-		if(*exprp=='n'){
-			exprp++;
+nextrec(Comp *c)
+{
+	if(c->exprp[0]==0 || (c->exprp[0]=='\\' && c->exprp[1]==0))
+		regerror(c, "malformed `[]'");
+	if(c->exprp[0] == '\\'){
+		c->exprp++;
+		if(*c->exprp=='n'){
+			c->exprp++;
 			return '\n';
 		}
-		return *exprp++|0x10000;
+		return *c->exprp++|0x10000;
 	}
-	return *exprp++;
+	return *c->exprp++;
 }
 
 void
-bldcclass(void)
+bldcclass(Comp *c)
 {
 	int c1, c2, n, na;
-	Rune *classp;
+	Rune *r;
+	Regexp *re;
 
-	classp = runemalloc(DCLASS);
-	n = 0;
+	re = c->re;
 	na = DCLASS;
+	r = runemalloc(2*na);
+	n = 0;
 	/* we have already seen the '[' */
-	if(*exprp == '^'){
-		classp[n++] = '\n';	/* don't match newline in negate case */
-		negateclass = TRUE;
-		exprp++;
+	if(*c->exprp == '^'){
+		r[0] = r[1] = '\n';	/* don't match newline in negate case */
+		n++;
+		c->negateclass = TRUE;
+		c->exprp++;
 	}else
-		negateclass = FALSE;
-	while((c1 = nextrec()) != ']'){
+		c->negateclass = FALSE;
+	while((c1 = nextrec(c)) != ']'){
 		if(c1 == '-'){
     Error:
-			free(classp);
-			regerror("malformed `[]'");
+			free(r);
+			regerror(c, "malformed `[]'");
 		}
-		if(n+4 >= na){		/* 3 runes plus NUL */
+		if(n == na){
 			na += DCLASS;
-			classp = runerealloc(classp, na);
+			r = runerealloc(r, 2*na);
 		}
-		if(*exprp == '-'){
-			exprp++;	/* eat '-' */
-			if((c2 = nextrec()) == ']')
+		c2 = c1;
+		if(*c->exprp == '-'){
+			c->exprp++;	/* eat '-' */
+			if((c2 = nextrec(c)) == ']')
 				goto Error;
-			classp[n+0] = Runemax;
-			classp[n+1] = c1;
-			classp[n+2] = c2;
-			n += 3;
-		}else
-			classp[n++] = c1;
+		}
+		r[2*n] = c1;
+		r[2*n+1] = c2;
+		n++;
 	}
-	classp[n] = 0;
-	if(nclass == Nclass){
-		Nclass += DCLASS;
-		class = realloc(class, Nclass*sizeof(Rune*));
+	if(re->nclass == c->Nclass){
+		c->Nclass += DCLASS;
+		re->class = erealloc(re->class, c->Nclass*sizeof(Class));
 	}
-	class[nclass++] = classp;
+	mkclass(&re->class[re->nclass++], r, n);
+}
+
+/*
+ * Sort and merge the n ranges in r, which the class keeps.
+ */
+static void
+mkclass(Class *cl, Rune *r, int n)
+{
+	int i, m;
+	Rune c;
+
+	qsort(r, n, 2*sizeof(Rune), runecmp);
+	m = 0;
+	for(i=0; i<n; i++){
+		if(r[2*i] > r[2*i+1])
+			continue;	/* backwards; matches nothing */
+		if(m>0 && r[2*i]<=r[2*m-1]+1){
+			if(r[2*i+1] > r[2*m-1])
+				r[2*m-1] = r[2*i+1];
+		}else{
+			r[2*m] = r[2*i];
+			r[2*m+1] = r[2*i+1];
+			m++;
+		}
+	}
+	cl->r = r;
+	cl->nr = m;
+	memset(cl->map, 0, sizeof cl->map);
+	for(i=0; i<m && r[2*i]<Runeself; i++)
+		for(c=r[2*i]; c<=r[2*i+1] && c<Runeself; c++)
+			cl->map[c/8] |= 1<<(c%8);
 }
 
 int
-classmatch(int classno, int c, int negate)
+classmatch(Regexp *re, int classno, int c, int negate)
 {
-	Rune *p;
+	Class *cl;
+	Rune *r;
+	int l, h, m;
 
-	p = class[classno];
-	while(*p){
-		if(*p == Runemax){
-			if(p[1]<=c && c<=p[2])
-				return !negate;
-			p += 3;
-		}else if(*p++ == c)
+	cl = &re->class[classno];
+	if(c < Runeself)
+		return ((cl->map[c/8]>>(c%8)) & 1) ^ negate;
+	r = cl->r;
+	l = 0;
+	h = cl->nr;
+	while(l < h){
+		m = (l+h)/2;
+		if(r[2*m+1] < c)
+			l = m+1;
+		else if(r[2*m] > c)
+			h = m;
+		else
 			return !negate;
 	}
 	return negate;
 }
 
+static void
+tlinit(Tlist *l, Inst *program, int n)
+{
+	l->nalloc = n;
+	l->t = erealloc(l->t, n*sizeof(Ilist));
+	l->program = program;
+	l->nprog = n;
+	l->where = erealloc(l->where, n*sizeof(int));
+	l->gen = erealloc(l->gen, n*sizeof(uint));
+	memset(l->gen, 0, n*sizeof(uint));
+	l->g = 1;
+	l->n = 0;
+}
+
+static void
+tlclear(Tlist *l)
+{
+	l->n = 0;
+	if(++l->g == 0){
+		memset(l->gen, 0, l->nprog*sizeof(uint));
+		l->g = 1;
+	}
+}
+
 /*
- * Note optimization in addinst:
- * 	*l must be pending when addinst called; if *l has been looked
- *		at already, the optimization is a bug.
+ * Threads l->t[from:] are still pending.  A pending thread already
+ * at inst takes the earlier start, but one that has run must not be
+ * changed, so if it started later the instruction is queued again.
+ * Starts only decrease, so the list stays finite.
  */
 int
-addinst(Ilist *l, Inst *inst, Rangeset *sep)
+addinst(Tlist *l, int from, Inst *inst, Rangeset *sep)
 {
 	Ilist *p;
+	Rangeset se;
+	int x;
 
-	for(p = l; p->inst; p++){
-		if(p->inst==inst){
-			if((sep)->r[0].q0 < p->se.r[0].q0)
-				p->se= *sep;	/* this would be bug */
+	x = inst-l->program;
+	if(l->gen[x] == l->g){
+		p = &l->t[l->where[x]];
+		if(sep->r[0].q0 >= p->se.r[0].q0)
 			return 0;	/* It's already there */
+		if(l->where[x] >= from){
+			p->se = *sep;
+			return 0;
 		}
 	}
+	se = *sep;	/* sep may point into l->t */
+	if(l->n == l->nalloc){
+		l->nalloc *= 2;
+		l->t = erealloc(l->t, l->nalloc*sizeof(Ilist));
+	}
+	p = &l->t[l->n];
 	p->inst = inst;
-	p->se= *sep;
-	(p+1)->inst = nil;
+	p->se = se;
+	l->gen[x] = l->g;
+	l->where[x] = l->n++;
 	return 1;
 }
 
+/* either t!=nil or r!=nil, and we match the string in the appropriate place */
 int
-rxnull(void)
+rxexecute(Regexp *re, Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
 {
-	return startinst==nil || bstartinst==nil;
+	Rxctx *x;
+	int m;
+
+	x = rxctx(re);
+	m = -1;
+	if(t!=nil && dosplit(t, t->file->b.nc))
+		m = pexecute(x, t, startp, eof, rp);
+	if(m<0 && !x->fdfa.failed && !x->bdfa.failed)
+		m = dexecute(x, t, r, startp, eof, rp);
+	if(m < 0)
+		m = nfaexecute(x, t, r, startp, eof, rp);
+	rxdone(x);
+	return m;
 }
 
-/* either t!=nil or r!=nil, and we match the string in the appropriate place */
-int
-rxexecute(Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
+static int
+nfaexecute(Rxctx *x, Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
 {
 	int flag;
 	Inst *inst;
 	Ilist *tlp;
+	Tlist *tl, *nl;	/* This list, next list */
+	Regexp *re;
+	Rangeset sempty;
+	Span sp;
 	uint p;
-	int nnl, ntl;
-	int nc, c;
+	int i, nc, c;
 	int wrapped;
 	int startchar;
 
+	re = x->re;
 	flag = 0;
 	p = startp;
 	startchar = 0;
 	wrapped = 0;
-	nnl = 0;
-	if(startinst->type<OPERATOR)
-		startchar = startinst->type;
-	list[0][0].inst = list[1][0].inst = nil;
-	sel.r[0].q0 = -1;
-	if(t != nil)
-		nc = t->file->b.nc;
-	else
-		nc = runestrlen(r);
+	if(re->startinst->type<OPERATOR)
+		startchar = re->startinst->type;
+	tlclear(&x->list[0]);
+	tlclear(&x->list[1]);
+	nl = &x->list[0];
+	memset(&sempty, 0, sizeof sempty);
+	x->sel.r[0].q0 = -1;
+	spaninit(&sp, t, r);
+	nc = sp.nc;
 	/* Execute machine once for each character */
 	for(;;p++){
 	doloop:
@@ -584,9 +1121,10 @@ rxexecute(Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
 			case 2:
 				break;
 			case 1:		/* expired; wrap to beginning */
-				if(sel.r[0].q0>=0 || eof!=Infinity)
+				if(x->sel.r[0].q0>=0 || eof!=Infinity)
 					goto Return;
-				list[0][0].inst = list[1][0].inst = nil;
+				tlclear(&x->list[0]);
+				tlclear(&x->list[1]);
 				p = 0;
 				goto doloop;
 			default:
@@ -594,42 +1132,31 @@ rxexecute(Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
 			}
 			c = 0;
 		}else{
-			if(((wrapped && p>=startp) || sel.r[0].q0>0) && nnl==0)
+			if(((wrapped && p>=startp) || x->sel.r[0].q0>0) && nl->n==0)
 				break;
-			if(t != nil)
-				c = textreadc(t, p);
-			else
-				c = r[p];
+			c = spanc(&sp, p);
 		}
 		/* fast check for first char */
-		if(startchar && nnl==0 && c!=startchar)
+		if(startchar && nl->n==0 && c!=startchar)
 			continue;
-		tl = list[flag];
-		nl = list[flag^=1];
-		nl->inst = nil;
-		ntl = nnl;
-		nnl = 0;
-		if(sel.r[0].q0<0 && (!wrapped || p<startp || startp==eof)){
+		tl = &x->list[flag];
+		nl = &x->list[flag^=1];
+		tlclear(nl);
+		if(x->sel.r[0].q0<0 && (!wrapped || p<startp || startp==eof)){
 			/* Add first instruction to this list */
 			sempty.r[0].q0 = p;
-			if(addinst(tl, startinst, &sempty))
-			if(++ntl >= NLIST){
-	Overflow:
-				warning(nil, "regexp list overflow\n");
-				sel.r[0].q0 = -1;
-				goto Return;
-			}
+			addinst(tl, 0, re->startinst, &sempty);
 		}
 		/* Execute machine until this list is empty */
-		for(tlp = tl; inst = tlp->inst; tlp++){	/* assignment = */
+		for(i=0; i<tl->n; i++){
+			tlp = &tl->t[i];
+			inst = tlp->inst;
 	Switchstmt:
 			switch(inst->type){
 			default:	/* regular character */
 				if(inst->type==c){
 	Addinst:
-					if(addinst(nl, inst->u1.next, &tlp->se))
-					if(++nnl >= NLIST)
-						goto Overflow;
+					addinst(nl, 0, inst->u1.next, &tlp->se);
 				}
 				break;
 			case LBRA:
@@ -647,7 +1174,7 @@ rxexecute(Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
 					goto Addinst;
 				break;
 			case BOL:
-				if(p==0 || (t!=nil && textreadc(t, p-1)=='\n') || (r!=nil && r[p-1]=='\n')){
+				if(p==0 || spanc(&sp, p-1)=='\n'){
 	Step:
 					inst = inst->u1.next;
 					goto Switchstmt;
@@ -658,62 +1185,84 @@ rxexecute(Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
 					goto Step;
 				break;
 			case CCLASS:
-				if(c>=0 && classmatch(inst->u.class, c, 0))
+				if(c>=0 && classmatch(re, inst->u.class, c, 0))
 					goto Addinst;
 				break;
 			case NCCLASS:
-				if(c>=0 && classmatch(inst->u.class, c, 1))
+				if(c>=0 && classmatch(re, inst->u.class, c, 1))
 					goto Addinst;
 				break;
 			case OR:
 				/* evaluate right choice later */
-				if(addinst(tlp, inst->u.right, &tlp->se))
-				if(++ntl >= NLIST)
-					goto Overflow;
+				addinst(tl, i, inst->u.right, &tlp->se);
+				tlp = &tl->t[i];	/* tl may have moved */
 				/* efficiency: advance and re-evaluate */
 				inst = inst->u1.left;
 				goto Switchstmt;
 			case END:	/* Match! */
 				tlp->se.r[0].q1 = p;
-				newmatch(&tlp->se);
+				newmatch(x, &tlp->se);
 				break;
 			}
 		}
 	}
     Return:
-	*rp = sel;
-	return sel.r[0].q0 >= 0;
+	*rp = x->sel;
+	return x->sel.r[0].q0 >= 0;
 }
 
 void
-newmatch(Rangeset *sp)
+newmatch(Rxctx *x, Rangeset *sp)
 {
-	if(sel.r[0].q0<0 || sp->r[0].q0<sel.r[0].q0 ||
-	   (sp->r[0].q0==sel.r[0].q0 && sp->r[0].q1>sel.r[0].q1))
-		sel = *sp;
+	if(x->sel.r[0].q0<0 || sp->r[0].q0<x->sel.r[0].q0 ||
+	   (sp->r[0].q0==x->sel.r[0].q0 && sp->r[0].q1>x->sel.r[0].q1))
+		x->sel = *sp;
 }
 
 int
-rxbexecute(Text *t, uint startp, Rangeset *rp)
+rxbexecute(Regexp *re, Text *t, uint startp, Rangeset *rp)
+{
+	Rxctx *x;
+	int m;
+
+	x = rxctx(re);
+	m = -1;
+	if(!x->fdfa.failed && !x->bdfa.failed)
+		m = dbexecute(x, t, startp, rp);
+	if(m < 0)
+		m = nfabexecute(x, t, startp, rp);
+	rxdone(x);
+	return m;
+}
+
+static int
+nfabexecute(Rxctx *x, Text *t, uint startp, Rangeset *rp)
 {
 	int flag;
 	Inst *inst;
 	Ilist *tlp;
-	int p;
-	int nnl, ntl;
+	Tlist *tl, *nl;	/* This list, next list */
+	Regexp *re;
+	Rangeset se, sempty;
+	Span sp;
+	int i, p;
 	int c;
 	int wrapped;
 	int startchar;
 
+	re = x->re;
 	flag = 0;
-	nnl = 0;
 	wrapped = 0;
 	p = startp;
 	startchar = 0;
-	if(bstartinst->type<OPERATOR)
-		startchar = bstartinst->type;
-	list[0][0].inst = list[1][0].inst = nil;
-	sel.r[0].q0= -1;
+	if(re->bstartinst->type<OPERATOR)
+		startchar = re->bstartinst->type;
+	tlclear(&x->list[0]);
+	tlclear(&x->list[1]);
+	nl = &x->list[0];
+	memset(&sempty, 0, sizeof sempty);
+	x->sel.r[0].q0= -1;
+	spaninit(&sp, t, nil);
 	/* Execute machine once for each character, including terminal NUL */
 	for(;;--p){
 	doloop:
@@ -723,10 +1272,11 @@ rxbexecute(Text *t, uint startp, Rangeset *rp)
 			case 2:
 				break;
 			case 1:		/* expired; wrap to end */
-				if(sel.r[0].q0>=0)
+				if(x->sel.r[0].q0>=0)
 					goto Return;
-				list[0][0].inst = list[1][0].inst = nil;
-				p = t->file->b.nc;
+				tlclear(&x->list[0]);
+				tlclear(&x->list[1]);
+				p = sp.nc;
 				goto doloop;
 			case 3:
 			default:
@@ -734,40 +1284,32 @@ rxbexecute(Text *t, uint startp, Rangeset *rp)
 			}
 			c = 0;
 		}else{
-			if(((wrapped && p<=startp) || sel.r[0].q0>0) && nnl==0)
+			if(((wrapped && p<=startp) || x->sel.r[0].q0>0) && nl->n==0)
 				break;
-			c = textreadc(t, p-1);
+			c = spanc(&sp, p-1);
 		}
 		/* fast check for first char */
-		if(startchar && nnl==0 && c!=startchar)
+		if(startchar && nl->n==0 && c!=startchar)
 			continue;
-		tl = list[flag];
-		nl = list[flag^=1];
-		nl->inst = nil;
-		ntl = nnl;
-		nnl = 0;
-		if(sel.r[0].q0<0 && (!wrapped || p>startp)){
+		tl = &x->list[flag];
+		nl = &x->list[flag^=1];
+		tlclear(nl);
+		if(x->sel.r[0].q0<0 && (!wrapped || p>startp)){
 			/* Add first instruction to this list */
 			/* the minus is so the optimizations in addinst work */
 			sempty.r[0].q0 = -p;
-			if(addinst(tl, bstartinst, &sempty))
-			if(++ntl >= NLIST){
-	Overflow:
-				warning(nil, "regexp list overflow\n");
-				sel.r[0].q0 = -1;
-				goto Return;
-			}
+			addinst(tl, 0, re->bstartinst, &sempty);
 		}
 		/* Execute machine until this list is empty */
-		for(tlp = tl; inst = tlp->inst; tlp++){	/* assignment = */
+		for(i=0; i<tl->n; i++){
+			tlp = &tl->t[i];
+			inst = tlp->inst;
 	Switchstmt:
 			switch(inst->type){
 			default:	/* regular character */
 				if(inst->type == c){
 	Addinst:
-					if(addinst(nl, inst->u1.next, &tlp->se))
-					if(++nnl >= NLIST)
-						goto Overflow;
+					addinst(nl, 0, inst->u1.next, &tlp->se);
 				}
 				break;
 			case LBRA:
@@ -792,46 +1334,1227 @@ rxbexecute(Text *t, uint startp, Rangeset *rp)
 				}
 				break;
 			case EOL:
-				if(p<t->file->b.nc && textreadc(t, p)=='\n')
+				if(p<sp.nc && spanc(&sp, p)=='\n')
 					goto Step;
 				break;
 			case CCLASS:
-				if(c>0 && classmatch(inst->u.class, c, 0))
+				if(c>0 && classmatch(re, inst->u.class, c, 0))
 					goto Addinst;
 				break;
 			case NCCLASS:
-				if(c>0 && classmatch(inst->u.class, c, 1))
+				if(c>0 && classmatch(re, inst->u.class, c, 1))
 					goto Addinst;
 				break;
 			case OR:
 				/* evaluate right choice later */
-				if(addinst(tl, inst->u.right, &tlp->se))
-				if(++ntl >= NLIST)
-					goto Overflow;
+				addinst(tl, i, inst->u.right, &tlp->se);
+				tlp = &tl->t[i];	/* tl may have moved */
 				/* efficiency: advance and re-evaluate */
 				inst = inst->u1.left;
 				goto Switchstmt;
 			case END:	/* Match! */
-				tlp->se.r[0].q0 = -tlp->se.r[0].q0; /* minus sign */
-				tlp->se.r[0].q1 = p;
-				bnewmatch(&tlp->se);
+				se = tlp->se;	/* keep the thread's start for addinst */
+				se.r[0].q0 = -se.r[0].q0; /* minus sign */
+				se.r[0].q1 = p;
+				bnewmatch(x, &se);
 				break;
 			}
 		}
 	}
     Return:
-	*rp = sel;
-	return sel.r[0].q0 >= 0;
+	*rp = x->sel;
+	return x->sel.r[0].q0 >= 0;
 }
 
 void
-bnewmatch(Rangeset *sp)
+bnewmatch(Rxctx *x, Rangeset *sp)
 {
         int  i;
+        Rangeset *sel;
 
-        if(sel.r[0].q0<0 || sp->r[0].q0>sel.r[0].q1 || (sp->r[0].q0==sel.r[0].q1 && sp->r[0].q1<sel.r[0].q0))
+        sel = &x->sel;
+        if(sel->r[0].q0<0 || sp->r[0].q0>sel->r[0].q1 || (sp->r[0].q0==sel->r[0].q1 && sp->r[0].q1<sel->r[0].q0))
                 for(i = 0; i<NRange; i++){       /* note the reversal; q0<=q1 */
-                        sel.r[i].q0 = sp->r[i].q1;
-                        sel.r[i].q1 = sp->r[i].q0;
+                        sel->r[i].q0 = sp->r[i].q1;
+                        sel->r[i].q1 = sp->r[i].q0;
                 }
 }
+
+static void
+spaninit(Span *sp, Text *t, Rune *r)
+{
+	sp->t = t;
+	sp->r = r;
+	if(t != nil)
+		sp->nc = t->file->b.nc;
+	else
+		sp->nc = runestrlen(r);
+	sp->s = nil;
+	sp->q0 = 0;
+	sp->q1 = 0;
+}
+
+/* p must be in the text */
+static void
+spanat(Span *sp, long p)
+{
+	uint q0, q1;
+
+	if(sp->t == nil){
+		sp->s = sp->r;
+		sp->q0 = 0;
+		sp->q1 = sp->nc;
+	}else if(sp->t->ncache != 0){
+		sp->one = textreadc(sp->t, p);
+		sp->s = &sp->one;
+		sp->q0 = p;
+		sp->q1 = p+1;
+	}else{
+		sp->s = bufspan(&sp->t->file->b, p, &q0, &q1);
+		sp->q0 = q0;
+		sp->q1 = q1;
+	}
+}
+
+/* the n runes at r, which need not end in NUL */
+static void
+spanrunes(Span *sp, Rune *r, long n)
+{
+	sp->t = nil;
+	sp->r = r;
+	sp->nc = n;
+	sp->s = nil;
+	sp->q0 = 0;
+	sp->q1 = 0;
+}
+
+static Rune
+spanc(Span *sp, long p)
+{
+	if(p<sp->q0 || p>=sp->q1)
+		spanat(sp, p);
+	return sp->s[p-sp->q0];
+}
+
+static int
+runecmp(const void *a, const void *b)
+{
+	Rune x, y;
+
+	x = *(Rune*)a;
+	y = *(Rune*)b;
+	if(x < y)
+		return -1;
+	return x > y;
+}
+
+/*
+ * Split the runes into classes no instruction tells apart: a class
+ * starts at every rune where some literal or [] range starts or ends.
+ * 0 and newline get classes of their own.
+ */
+static void
+mkclasses(Regexp *re)
+{
+	Inst *i;
+	Class *cl;
+	Rune *p, *cb;
+	int n, na, c;
+
+	na = 64;
+	cb = runemalloc(na);
+	n = 0;
+	cb[n++] = 0;
+	cb[n++] = 1;
+	cb[n++] = '\n';
+	cb[n++] = '\n'+1;
+	for(i=re->program; i<re->progp; i++){
+		switch(i->type){
+		case LBRA:
+		case RBRA:
+		case ANY:
+		case BOL:
+		case EOL:
+		case OR:
+		case END:
+			continue;
+		case CCLASS:
+		case NCCLASS:
+			cl = &re->class[i->u.class];
+			for(p=cl->r; p<cl->r+2*cl->nr; p+=2){
+				if(n+2 > na){
+					na *= 2;
+					cb = runerealloc(cb, na);
+				}
+				cb[n++] = p[0];
+				cb[n++] = p[1]+1;
+			}
+			continue;
+		}
+		if(n+2 > na){
+			na *= 2;
+			cb = runerealloc(cb, na);
+		}
+		cb[n++] = i->type;
+		cb[n++] = i->type+1;
+	}
+	qsort(cb, n, sizeof(Rune), runecmp);
+	re->ncbound = 1;
+	for(c=1; c<n; c++)
+		if(cb[c] != cb[re->ncbound-1])
+			cb[re->ncbound++] = cb[c];
+	for(c=0; c<Runeself; c++){
+		for(n=re->ncbound-1; cb[n]>c; n--)
+			;
+		re->cascii[c] = n;
+	}
+	re->cbound = cb;
+}
+
+static int
+charclass(Regexp *re, Rune c)
+{
+	int l, h, m;
+
+	if(c < Runeself)
+		return re->cascii[c];
+	l = 0;
+	h = re->ncbound;
+	while(l+1 < h){
+		m = (l+h)/2;
+		if(re->cbound[m] <= c)
+			l = m;
+		else
+			h = m;
+	}
+	return l;
+}
+
+static void
+dfafree(Dfa *d)
+{
+	Dstate *s, *n;
+	int i;
+
+	for(i=0; i<Ndhash; i++){
+		for(s=d->hash[i]; s; s=n){
+			n = s->hnext;
+			free(s);
+		}
+		d->hash[i] = nil;
+	}
+	d->mem = 0;
+	d->failed = FALSE;
+}
+
+static Dstate*
+dcache(Rxctx *x, Dfa *d, int *inst, int n, int flag)
+{
+	Dstate *s;
+	uint h;
+	long m;
+	int i, nc;
+
+	h = flag;
+	for(i=0; i<n; i++)
+		h = h*31+inst[i];
+	h %= Ndhash;
+	for(s=d->hash[h]; s; s=s->hnext)
+		if(s->flag==flag && s->ninst==n && memcmp(s->inst, inst, n*sizeof(int))==0)
+			return s;
+	nc = x->re->ncbound;
+	m = sizeof(Dstate)+nc*(sizeof(Dstate*)+1)+n*sizeof(int);
+	if(d->mem+m > Dmem){
+		d->failed = TRUE;
+		return nil;
+	}
+	d->mem += m;
+	s = emalloc(m);
+	s->flag = flag;
+	s->ninst = n;
+	s->next = (Dstate**)(s+1);
+	s->inst = (int*)(s->next+nc);
+	s->match = (uchar*)(s->inst+n);
+	memmove(s->inst, inst, n*sizeof(int));
+	s->hnext = d->hash[h];
+	d->hash[h] = s;
+	return s;
+}
+
+static void
+dnewgen(Rxctx *x)
+{
+	int n;
+
+	if(++x->dgen == 0){
+		n = x->re->progp-x->re->program;
+		memset(x->dseen, 0, n*sizeof(uint));
+		memset(x->dnseen, 0, n*sizeof(uint));
+		x->dgen = 1;
+	}
+}
+
+static int
+dpush(Rxctx *x, int sp, Inst *i)
+{
+	int n;
+
+	n = i-x->re->program;
+	if(x->dseen[n] != x->dgen){
+		x->dseen[n] = x->dgen;
+		x->dstack[sp++] = n;
+	}
+	return sp;
+}
+
+static void
+dadd(Rxctx *x, Inst *i)
+{
+	int n;
+
+	n = i-x->re->program;
+	if(x->dnseen[n] != x->dgen){
+		x->dnseen[n] = x->dgen;
+		x->dinst[x->ndinst++] = n;
+	}
+}
+
+/*
+ * Run state s over c, or over the end of the text if c<0; nl says
+ * whether the assertion c decides ($ forwards, ^ backwards) holds.
+ * Leaves the next state's instructions in dinst and returns the
+ * group that reached END, or -1.
+ */
+static int
+dstep(Rxctx *x, Dfa *d, Dstate *s, int c, int nl, int addstart)
+{
+	Inst *inst, *program;
+	Regexp *re;
+	int i, g, mg, sp, n0, bol, eol, cmin;
+
+	re = x->re;
+	program = re->program;
+	dnewgen(x);
+	if(d->m->back){
+		bol = nl;
+		eol = s->flag&Fctx;
+		cmin = 1;
+	}else{
+		bol = s->flag&Fctx;
+		eol = nl;
+		cmin = 0;
+	}
+	x->ndinst = 0;
+	mg = -1;
+	i = 0;
+	for(g=0; mg<0; g++){
+		sp = 0;
+		if(i < s->ninst){
+			while(i<s->ninst && s->inst[i]!=Mark)
+				sp = dpush(x, sp, &program[s->inst[i++]]);
+			i++;
+		}else if(addstart){
+			sp = dpush(x, sp, d->m->start);
+			addstart = FALSE;
+		}else
+			break;
+		n0 = x->ndinst;
+		while(sp > 0){
+			inst = &program[x->dstack[--sp]];
+			switch(inst->type){
+			default:
+				if(inst->type == c)
+					dadd(x, inst->u1.next);
+				break;
+			case LBRA:
+			case RBRA:
+				sp = dpush(x, sp, inst->u1.next);
+				break;
+			case ANY:
+				if(c>=0 && c!='\n')
+					dadd(x, inst->u1.next);
+				break;
+			case BOL:
+				if(bol)
+					sp = dpush(x, sp, inst->u1.next);
+				break;
+			case EOL:
+				if(eol)
+					sp = dpush(x, sp, inst->u1.next);
+				break;
+			case CCLASS:
+				if(c>=cmin && classmatch(re, inst->u.class, c, 0))
+					dadd(x, inst->u1.next);
+				break;
+			case NCCLASS:
+				if(c>=cmin && classmatch(re, inst->u.class, c, 1))
+					dadd(x, inst->u1.next);
+				break;
+			case OR:
+				sp = dpush(x, sp, inst->u.right);
+				sp = dpush(x, sp, inst->u1.left);
+				break;
+			case END:
+				mg = g;
+				break;
+			}
+		}
+		if(x->ndinst > n0)
+			x->dinst[x->ndinst++] = Mark;
+	}
+	if(x->ndinst > 0)
+		x->ndinst--;
+	return mg;
+}
+
+static Dstate*
+dnext(Rxctx *x, Dfa *d, Dstate *s, int cl)
+{
+	Dstate *n;
+	int c, mg, flag;
+
+	c = x->re->cbound[cl];
+	mg = dstep(x, d, s, c, c=='\n', (s->flag&Fnostart)==0);
+	flag = s->flag&Fnostart;
+	if(mg >= 0)
+		flag = Fnostart;
+	if(c == '\n')
+		flag |= Fctx;
+	n = dcache(x, d, x->dinst, x->ndinst, flag);
+	if(n == nil)
+		return nil;
+	s->next[cl] = n;
+	s->match[cl] = mg>=0;
+	return n;
+}
+
+/*
+ * Where can a match begin?  Follow the machine from its first
+ * instruction through everything that reads no text, collecting the
+ * runes it could read first.  An assertion decided by that rune ($
+ * forwards, ^ backwards) adds newline.  No good if END is reached
+ * or almost any rune would do.  Forwards, also collect the literal
+ * that every match must begin with.
+ */
+static void
+mkmach(Rxctx *x, Mach *m, Inst *start, int back)
+{
+	Inst *i;
+	Class *cl;
+	int sp, c;
+
+	m->start = start;
+	m->back = back;
+	memset(m->first, 0, sizeof m->first);
+	m->firsthi = FALSE;
+	m->skip = FALSE;
+	m->lit.n = 0;
+	dnewgen(x);
+	sp = dpush(x, 0, start);
+	while(sp > 0){
+		i = &x->re->program[x->dstack[--sp]];
+		switch(i->type){
+		default:
+			if(i->type >= OPERATOR)
+				break;
+			if(i->type < Runeself)
+				m->first[i->type/8] |= 1<<(i->type%8);
+			else
+				m->firsthi = TRUE;
+			break;
+		case LBRA:
+		case RBRA:
+			sp = dpush(x, sp, i->u1.next);
+			break;
+		case BOL:
+		case EOL:
+			if((i->type==BOL) == back)
+				m->first['\n'/8] |= 1<<('\n'%8);
+			sp = dpush(x, sp, i->u1.next);
+			break;
+		case OR:
+			sp = dpush(x, sp, i->u.right);
+			sp = dpush(x, sp, i->u1.left);
+			break;
+		case CCLASS:
+			cl = &x->re->class[i->u.class];
+			for(c=0; c<Runeself/8; c++)
+				m->first[c] |= cl->map[c];
+			if(cl->nr>0 && cl->r[2*cl->nr-1]>=Runeself)
+				m->firsthi = TRUE;
+			break;
+		case NCCLASS:
+			for(c=1; c<Runeself; c++)
+				if(classmatch(x->re, i->u.class, c, 1))
+					m->first[c/8] |= 1<<(c%8);
+			m->firsthi = TRUE;
+			break;
+		case ANY:
+		case END:
+			return;
+		}
+	}
+	m->skip = TRUE;
+	if(back)
+		return;
+	for(i=start; m->lit.n<Nlit; i=i->u1.next){
+		if(i->type==LBRA || i->type==RBRA)
+			continue;
+		if(i->type >= OPERATOR)
+			break;
+		m->lit.r[m->lit.n++] = i->type;
+	}
+	mklit(&m->lit);
+}
+
+static void
+mklit(Lit *l)
+{
+	int i;
+
+	for(i=0; i<256; i++)
+		l->shift[i] = l->n;
+	for(i=0; i<l->n-1; i++)
+		l->shift[l->r[i]&0xFF] = l->n-1-i;
+}
+
+/* can END be reached from the first instruction without going through i? */
+static int
+avoids(Rxctx *x, Inst *i)
+{
+	Inst *program;
+	int sp;
+
+	program = x->re->program;
+	dnewgen(x);
+	x->dseen[i-program] = x->dgen;
+	sp = dpush(x, 0, x->re->startinst);
+	while(sp > 0){
+		i = &program[x->dstack[--sp]];
+		switch(i->type){
+		case END:
+			return TRUE;
+		case OR:
+			sp = dpush(x, sp, i->u.right);
+			sp = dpush(x, sp, i->u1.left);
+			break;
+		default:
+			sp = dpush(x, sp, i->u1.next);
+			break;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Find the longest run of literals every match must pass through:
+ * literals END cannot be reached without, each the next of the one
+ * before.
+ */
+static void
+mkreq(Rxctx *x)
+{
+	uchar must[NPROG];
+	Inst *i, *j, *program, *bprogram;
+	Regexp *re;
+	Lit l;
+
+	re = x->re;
+	program = re->program;
+	bprogram = re->bprogram;
+	for(i=program; i<bprogram; i++)
+		must[i-program] = i->type<OPERATOR && !avoids(x, i);
+	re->req.n = 0;
+	for(i=program; i<bprogram; i++){
+		l.n = 0;
+		for(j=i; j<bprogram && must[j-program] && l.n<Nlit; ){
+			l.r[l.n++] = j->type;
+			for(j=j->u1.next; j->type==LBRA || j->type==RBRA; j=j->u1.next)
+				;
+		}
+		if(l.n > re->req.n)
+			re->req = l;
+	}
+	mklit(&re->req);
+}
+
+/*
+ * The first q in [p, lim) where l occurs, ending by bound; lim if none.
+ */
+static long
+findlit(Span *sp, long p, long lim, long bound, Lit *l)
+{
+	Rune *s;
+	Rune c;
+	long e, h, o, q;
+	int k, n, moved;
+
+	n = l->n;
+	e = bound-n+1;
+	if(e > lim)
+		e = lim;
+	/* q is the last rune of the window */
+	for(q=p+n-1; q<e+n-1; ){
+		spanc(sp, q);
+		s = sp->s;
+		o = sp->q0;
+		h = min(sp->q1, e+n-1);
+		moved = FALSE;
+		while(q < h){
+			c = s[q-o];
+			if(c == l->r[n-1]){
+				if(q-n+1 >= o)
+					for(k=0; k<n-1 && s[q-n+1+k-o]==l->r[k]; k++)
+						;
+				else{
+					/* the window starts in an earlier block */
+					for(k=0; k<n-1 && spanc(sp, q-n+1+k)==l->r[k]; k++)
+						;
+					moved = TRUE;
+				}
+				if(k == n-1)
+					return q-n+1;
+			}
+			q += l->shift[c&0xFF];
+			if(moved)
+				break;
+		}
+	}
+	return lim;
+}
+
+static int
+isfirst(Mach *m, Rune c)
+{
+	if(c >= Runeself)
+		return m->firsthi;
+	return m->first[c/8] & (1<<(c%8));
+}
+
+/*
+ * Where from p towards lim could a match begin?  Backwards, that
+ * is the right-hand end of the match.
+ */
+static long
+dskip(Mach *m, Span *sp, long p, long lim, long bound)
+{
+	Rune *s;
+	long e;
+
+	if(p == lim)
+		return p;
+	if(isfirst(m, spanc(sp, m->back? p-1 : p)))
+		return p;
+	if(!m->back && m->lit.n>1)
+		return findlit(sp, p, lim, bound, &m->lit);
+	while(p != lim){
+		if(m->back){
+			spanc(sp, p-1);
+			e = max(sp->q0, lim);
+			s = sp->s+(p-sp->q0);
+			while(p>e && !isfirst(m, s[-1])){
+				s--;
+				p--;
+			}
+			if(p > e)
+				break;
+		}else{
+			spanc(sp, p);
+			e = min(sp->q1, lim);
+			s = sp->s+(p-sp->q0);
+			while(p<e && !isfirst(m, *s)){
+				s++;
+				p++;
+			}
+			if(p < e)
+				break;
+		}
+	}
+	return p;
+}
+
+
+/*
+ * Scan from p to bound in the machine's direction, starting no new
+ * threads from stop on, and step once more at the end of the text.
+ * Returns the last position where a match was seen, -1 if none was,
+ * or -2 if the machine ran out of room.  The runes of each span are
+ * stepped through together until the state has nothing running.
+ * If endnl is -1 the text goes on past bound, unread: there is no
+ * last step, and -3 says something was still running there.
+ */
+static long
+dscan(Rxctx *x, Dfa *d, Span *sp, Dstate *s, long p, long bound, long stop, int endstart, int endnl)
+{
+	Dstate *n;
+	Regexp *re;
+	Rune *r;
+	long m, q, e, lim;
+	int cl, back, skip, nshort;
+
+	re = x->re;
+	back = d->m->back;
+	m = -1;
+	skip = d->m->skip && (sp->t==nil || sp->t->ncache==0);
+	nshort = 0;
+	lim = bound;
+	if(back && stop>bound && stop<p)
+		lim = stop;
+	if(!back && stop<bound && stop>p)
+		lim = stop;
+	for(;;){
+		if(s->ninst==0 && (s->flag&Fnostart))
+			return m;
+		if(p == stop && (s->flag&Fnostart)==0){
+			if(s->nostart == nil)
+				s->nostart = dcache(x, d, s->inst, s->ninst, s->flag|Fnostart);
+			if(s->nostart == nil)
+				return -2;
+			s = s->nostart;
+			continue;
+		}
+		if(skip && s->ninst==0 && (s->flag&Fnostart)==0){
+			/* nothing running: go where a match could begin */
+			q = dskip(d->m, sp, p, lim, bound);
+			/* not worth it if the runes it looks for are common */
+			if(q-p<16 && p-q<16 && ++nshort>32)
+				skip = FALSE;
+			if(q != p){
+				p = q;
+				if(back)
+					s = dinit(x, d, p<sp->nc && spanc(sp, p)=='\n', FALSE);
+				else
+					s = dinit(x, d, p==0 || spanc(sp, p-1)=='\n', FALSE);
+				if(s == nil)
+					return -2;
+				continue;
+			}
+		}
+		if(back){
+			if(p <= bound)
+				break;
+			spanc(sp, p-1);
+			e = max(sp->q0, bound);
+			if(stop<p && stop>e)
+				e = stop;
+			r = sp->s+(p-sp->q0);
+			do{
+				cl = charclass(re, *--r);
+				n = s->next[cl];
+				if(n==nil && (n=dnext(x, d, s, cl))==nil)
+					return -2;
+				if(s->match[cl])
+					m = p;
+				s = n;
+				p--;
+			}while(p>e && (s->ninst!=0 || (!skip && (s->flag&Fnostart)==0)));
+		}else{
+			if(p >= bound)
+				break;
+			spanc(sp, p);
+			e = min(sp->q1, bound);
+			if(stop>p && stop<e)
+				e = stop;
+			r = sp->s+(p-sp->q0);
+			do{
+				cl = charclass(re, *r++);
+				n = s->next[cl];
+				if(n==nil && (n=dnext(x, d, s, cl))==nil)
+					return -2;
+				if(s->match[cl])
+					m = p;
+				s = n;
+				p++;
+			}while(p<e && (s->ninst!=0 || (!skip && (s->flag&Fnostart)==0)));
+		}
+	}
+	if(endnl < 0)
+		return -3;
+	if(dstep(x, d, s, -1, endnl, endstart && (s->flag&Fnostart)==0) >= 0)
+		m = p;
+	return m;
+}
+
+/*
+ * The state before any character, with no threads, or, if start,
+ * with just the machine's first instruction and no more to come.
+ */
+static Dstate*
+dinit(Rxctx *x, Dfa *d, int ctx, int start)
+{
+	int i;
+
+	if(!start)
+		return dcache(x, d, nil, 0, ctx? Fctx : 0);
+	i = d->m->start-x->re->program;
+	return dcache(x, d, &i, 1, (ctx? Fctx : 0)|Fnostart);
+}
+
+static int
+dexecute(Rxctx *x, Text *t, Rune *r, uint startp, uint eof, Rangeset *rp)
+{
+	Dstate *s;
+	Regexp *re;
+	Span sp;
+	long nc, end, lo, q0, q1;
+	int i, lit;
+
+	re = x->re;
+	spaninit(&sp, t, r);
+	nc = sp.nc;
+	end = nc;
+	if(eof < end)
+		end = eof;
+	if(end < startp)
+		end = startp;
+	lo = startp;
+	lit = re->req.n>re->fmach.lit.n && (t==nil || t->ncache==0);
+	s = dinit(x, &x->fdfa, startp==0 || spanc(&sp, startp-1)=='\n', FALSE);
+	if(s == nil)
+		return -1;
+	q1 = -1;
+	if(!lit || findlit(&sp, startp, end, end, &re->req)<end)
+		q1 = dscan(x, &x->fdfa, &sp, s, startp, end, -1, startp==eof, FALSE);
+	if(q1==-1 && eof==Infinity){
+		lo = 0;
+		end = nc;
+		s = dinit(x, &x->fdfa, TRUE, FALSE);
+		if(s == nil)
+			return -1;
+		if(!lit || findlit(&sp, 0, nc, nc, &re->req)<nc)
+			q1 = dscan(x, &x->fdfa, &sp, s, 0, nc, startp, FALSE, FALSE);
+	}
+	if(q1 == -2)
+		return -1;
+	if(q1 == -1){
+		x->sel.r[0].q0 = -1;
+		*rp = x->sel;
+		return FALSE;
+	}
+	/* the NFA saw the end of the text as 0, not newline */
+	s = dinit(x, &x->bdfa, q1<end && spanc(&sp, q1)=='\n', TRUE);
+	if(s == nil)
+		return -1;
+	q0 = dscan(x, &x->bdfa, &sp, s, q1, lo, -1, FALSE, lo==0 || spanc(&sp, lo-1)=='\n');
+	if(q0 < 0)
+		return -1;
+	if(re->nsubexp > 0)
+		return nfaexecute(x, t, r, q0, q1<end? q1+1 : end, rp);
+	for(i=0; i<NRange; i++)
+		x->sel.r[i].q0 = x->sel.r[i].q1 = 0;
+	x->sel.r[0].q0 = q0;
+	x->sel.r[0].q1 = q1;
+	*rp = x->sel;
+	return TRUE;
+}
+
+/* callers use only r[0] of a backward match */
+static int
+dbexecute(Rxctx *x, Text *t, uint startp, Rangeset *rp)
+{
+	Dstate *s;
+	Regexp *re;
+	Span sp;
+	long nc, hi, q0, q1;
+	int i, lit;
+
+	re = x->re;
+	spaninit(&sp, t, nil);
+	nc = sp.nc;
+	hi = startp;
+	lit = re->req.n>0 && t->ncache==0;
+	s = dinit(x, &x->bdfa, startp<nc && spanc(&sp, startp)=='\n', FALSE);
+	if(s == nil)
+		return -1;
+	q0 = -1;
+	if(!lit || findlit(&sp, 0, startp, startp, &re->req)<startp)
+		q0 = dscan(x, &x->bdfa, &sp, s, startp, 0, -1, FALSE, TRUE);
+	if(q0 == -1){
+		hi = nc;
+		s = dinit(x, &x->bdfa, FALSE, FALSE);
+		if(s == nil)
+			return -1;
+		if(!lit || findlit(&sp, 0, nc, nc, &re->req)<nc)
+			q0 = dscan(x, &x->bdfa, &sp, s, nc, 0, startp, FALSE, TRUE);
+	}
+	if(q0 == -2)
+		return -1;
+	if(q0 == -1){
+		x->sel.r[0].q0 = -1;
+		*rp = x->sel;
+		return FALSE;
+	}
+	s = dinit(x, &x->fdfa, q0==0 || spanc(&sp, q0-1)=='\n', TRUE);
+	if(s == nil)
+		return -1;
+	q1 = dscan(x, &x->fdfa, &sp, s, q0, hi, -1, FALSE, hi<nc && spanc(&sp, hi)=='\n');
+	if(q1 < 0)
+		return -1;
+	for(i=0; i<NRange; i++)
+		x->sel.r[i].q0 = x->sel.r[i].q1 = 0;
+	x->sel.r[0].q0 = q0;
+	x->sel.r[0].q1 = q1;
+	*rp = x->sel;
+	return TRUE;
+}
+
+/*
+ * The leftmost-longest match starting from lo to hi in the text of
+ * sp, which ends at end unless more.  Returns TRUE or FALSE, -1 if
+ * the machine ran out of room, or -3 if a match might run on past
+ * end.
+ */
+static int
+dfirst(Rxctx *x, Span *sp, long lo, long hi, long end, int more, long *q0p, long *q1p)
+{
+	Dstate *s;
+	long q0, q1;
+
+	if(x->fdfa.failed || x->bdfa.failed)
+		return -1;
+	s = dinit(x, &x->fdfa, lo==0 || spanc(sp, lo-1)=='\n', FALSE);
+	if(s == nil)
+		return -1;
+	q1 = dscan(x, &x->fdfa, sp, s, lo, end, hi, FALSE, more? -1 : FALSE);
+	if(q1 == -1)
+		return FALSE;
+	if(q1 < 0)
+		return q1==-2? -1 : -3;
+	s = dinit(x, &x->bdfa, q1<end && spanc(sp, q1)=='\n', TRUE);
+	if(s == nil)
+		return -1;
+	q0 = dscan(x, &x->bdfa, sp, s, q1, lo, -1, FALSE, lo==0 || spanc(sp, lo-1)=='\n');
+	if(q0 < 0)
+		return -1;
+	*q0p = q0;
+	*q1p = q1;
+	return TRUE;
+}
+
+static void
+chunksearch(Rxchunk *c)
+{
+	Rxctx *x;
+	Rxfound *f;
+	Span sp;
+	long p, q0, q1;
+	int m;
+
+	x = rxctx(c->re);
+	spanrunes(&sp, c->r, c->n);
+	for(p=c->lo; p<c->hi; p=(q0==q1? q1+1 : q1)){
+		m = dfirst(x, &sp, p-c->off, c->hi-c->off, c->n, c->more, &q0, &q1);
+		if(m < 0)
+			break;
+		if(c->nf == c->nfalloc){
+			c->nfalloc += 64;
+			c->f = erealloc(c->f, c->nfalloc*sizeof(Rxfound));
+		}
+		f = &c->f[c->nf++];
+		f->p = p;
+		f->q0 = -1;
+		if(!m)
+			break;
+		q0 += c->off;
+		q1 += c->off;
+		f->q0 = q0;
+		f->q1 = q1;
+		if(!c->all)
+			break;
+	}
+	rxdone(x);
+}
+
+static void
+searchproc(void *v)
+{
+	Rxchunk *c;
+
+	USED(v);
+	threadsetname("searchproc");
+	for(;;){
+		c = recvp(csearch);
+		c->nf = 0;
+		if(!c->cancel)
+			chunksearch(c);
+		sendp(c->done, c);
+	}
+}
+
+/* is a search over n runes of t worth cutting into chunks? */
+static int
+dosplit(Text *t, long n)
+{
+	int np;
+
+	if(nsearchproc == 0){
+		qlock(&rxlk);	/* editprocs may get here at once */
+		if(nsearchproc == 0){
+			parsearch = (long)envint("parsearch", Parsearch)*1024*1024;
+			np = envint("searchprocs", sysconf(_SC_NPROCESSORS_ONLN));
+			if(np < 1)
+				np = 1;
+			nsearchproc = np;
+		}
+		qunlock(&rxlk);
+	}
+	return nsearchproc>1 && t->ncache==0 && n>=parsearch;
+}
+
+static Rxscan*
+scanopen(Rxctx *x, Text *t, long lo, long hi, long end, int all)
+{
+	Rxscan *sc;
+	int i;
+
+	sc = emalloc(sizeof(Rxscan));
+	sc->x = x;
+	sc->t = t;
+	sc->lo = lo;
+	sc->hi = hi;
+	sc->end = end;
+	sc->next = lo;
+	if(!dosplit(t, hi-lo))
+		return sc;
+	qlock(&rxlk);
+	if(csearch == nil){
+		csearch = chancreate(sizeof(Rxchunk*), 0);
+		for(i=0; i<nsearchproc; i++)
+			proccreate(searchproc, nil, STACK);
+	}
+	qunlock(&rxlk);
+	sc->nc = 2*nsearchproc;
+	if(sc->nc > (hi-lo)/Searchchunk+1)
+		sc->nc = (hi-lo)/Searchchunk+1;
+	sc->c = emalloc(sc->nc*sizeof(Rxchunk));
+	for(i=0; i<sc->nc; i++){
+		sc->c[i].re = x->re;
+		sc->c[i].all = all;
+		sc->c[i].r = runemalloc(1+Searchchunk+Searchwin);
+		sc->c[i].done = chancreate(sizeof(Rxchunk*), 1);
+	}
+	return sc;
+}
+
+/* read the next chunk, with the rune before it and a window after, and send it */
+static void
+scansend(Rxscan *sc)
+{
+	Rxchunk *c;
+	long e;
+
+	c = &sc->c[(sc->head+sc->nin)%sc->nc];
+	c->lo = sc->next;
+	c->hi = c->lo+Searchchunk;
+	if(c->hi > sc->hi)
+		c->hi = sc->hi;
+	e = c->hi+Searchwin;
+	if(e > sc->end)
+		e = sc->end;
+	c->off = c->lo;
+	if(c->off > 0)
+		c->off--;
+	c->n = e-c->off;
+	c->more = e<sc->end;
+	c->cancel = FALSE;
+	bufread(&sc->t->file->b, c->off, c->r, c->n);
+	sendp(csearch, c);
+	sc->next = c->hi;
+	sc->nin++;
+}
+
+/* finish with the head chunk */
+static void
+scandrop(Rxscan *sc)
+{
+	if(!sc->got)
+		recvp(sc->c[sc->head].done);
+	sc->got = FALSE;
+	sc->head = (sc->head+1)%sc->nc;
+	sc->nin--;
+}
+
+/*
+ * The leftmost-longest match starting from p, no earlier than the
+ * last asked for, to hi.  Returns TRUE or FALSE, or -1 if the
+ * machine ran out of room.
+ */
+static int
+scannext(Rxscan *sc, long p, long *q0p, long *q1p)
+{
+	Rxchunk *c;
+	Rxfound *f;
+	Span sp;
+	long hi;
+	int m;
+
+	while(p < sc->hi){
+		hi = sc->hi;
+		f = nil;
+		if(sc->c != nil){
+			while(sc->nin<sc->nc && sc->next<sc->hi)
+				scansend(sc);
+			c = &sc->c[sc->head];
+			if(p >= c->hi){
+				scandrop(sc);
+				continue;
+			}
+			if(!sc->got){
+				recvp(c->done);
+				sc->got = TRUE;
+				sc->k = 0;
+			}
+			while(sc->k<c->nf && c->f[sc->k].p<p)
+				sc->k++;
+			if(sc->k<c->nf && c->f[sc->k].p==p)
+				f = &c->f[sc->k];
+			hi = c->hi;
+		}
+		if(f != nil){
+			m = f->q0 >= 0;
+			*q0p = f->q0;
+			*q1p = f->q1;
+		}else{
+			/* not looked for from p: search the rest of the chunk here */
+			spaninit(&sp, sc->t, nil);
+			m = dfirst(sc->x, &sp, p, hi, sc->end, FALSE, q0p, q1p);
+			if(m < 0)
+				return -1;
+		}
+		if(m)
+			return TRUE;
+		p = hi;
+	}
+	return FALSE;
+}
+
+static void
+scanclose(Rxscan *sc)
+{
+	int i;
+
+	if(sc->c != nil){
+		for(i=0; i<sc->nin; i++)
+			sc->c[(sc->head+i)%sc->nc].cancel = TRUE;
+		while(sc->nin > 0)
+			scandrop(sc);
+		for(i=0; i<sc->nc; i++){
+			free(sc->c[i].r);
+			free(sc->c[i].f);
+			chanfree(sc->c[i].done);
+		}
+		free(sc->c);
+	}
+	free(sc);
+}
+
+/*
+ * A forward search of a big text, cut into chunks for the
+ * searchprocs: from startp on and then, wrapping around, before it.
+ */
+static int
+pexecute(Rxctx *x, Text *t, uint startp, uint eof, Rangeset *rp)
+{
+	Rxscan *sc;
+	long nc, end, q0, q1;
+	int i, m;
+
+	nc = t->file->b.nc;
+	end = nc;
+	if(eof < end)
+		end = eof;
+	if(startp>=end || !dosplit(t, end-startp))
+		return -1;
+	sc = scanopen(x, t, startp, end, end, FALSE);
+	m = scannext(sc, startp, &q0, &q1);
+	scanclose(sc);
+	if(m==FALSE && eof==Infinity){
+		end = nc;
+		sc = scanopen(x, t, 0, startp, nc, FALSE);
+		m = scannext(sc, 0, &q0, &q1);
+		scanclose(sc);
+	}
+	if(m < 0)
+		return -1;
+	if(!m){
+		x->sel.r[0].q0 = -1;
+		*rp = x->sel;
+		return FALSE;
+	}
+	if(x->re->nsubexp > 0)
+		return nfaexecute(x, t, nil, q0, q1<end? q1+1 : end, rp);
+	for(i=0; i<NRange; i++)
+		x->sel.r[i].q0 = x->sel.r[i].q1 = 0;
+	x->sel.r[0].q0 = q0;
+	x->sel.r[0].q1 = q1;
+	*rp = x->sel;
+	return TRUE;
+}
+
+/*
+ * The ranges x/re/, or, if y, y/re/, selects from q0 to q1 of t, in
+ * one pass forward; *np is set to how many.  What rxexecute would
+ * find from each place the loop looks next comes from the scan, so
+ * there is no starting over and no wrapping around; only r[0] of a
+ * match is wanted.
+ */
+Range*
+rxmatches(Regexp *re, Text *t, uint q0, uint q1, int y, int *np)
+{
+	Rxctx *x;
+	Rxscan *sc;
+	Rangeset rs;
+	Range m, tr, *rp;
+	long p, op, qa, qb;
+	int n, nalloc, found;
+
+	x = rxctx(re);
+	sc = scanopen(x, t, q0, q1, q1, TRUE);
+	op = y? q0 : -1;
+	n = 0;
+	nalloc = 0;
+	rp = nil;
+	for(p=q0; p<=q1; ){
+		found = -1;
+		if(p < q1)
+			found = scannext(sc, p, &qa, &qb);
+		if(found < 0){
+			/* at the end, or the machine is out of room */
+			found = rxexecute(re, t, nil, p, q1, &rs);
+			m = rs.r[0];
+		}else if(found){
+			m.q0 = qa;
+			m.q1 = qb;
+		}
+		if(!found){	/* no match, but y should still run */
+			if(!y || op>q1)
+				break;
+			tr.q0 = op, tr.q1 = q1;
+			p = q1+1;	/* exit next loop */
+			m.q1 = op;
+		}else{
+			if(m.q0==m.q1){	/* empty match? */
+				if(m.q0==op){
+					p++;
+					continue;
+				}
+				p = m.q1+1;
+			}else
+				p = m.q1;
+			if(!y)
+				tr = m;
+			else
+				tr.q0 = op, tr.q1 = m.q0;
+		}
+		op = m.q1;
+		if(n == nalloc){
+			nalloc = 2*nalloc+16;
+			rp = erealloc(rp, nalloc*sizeof(Range));
+		}
+		rp[n++] = tr;
+	}
+	scanclose(sc);
+	rxdone(x);
+	*np = n;
+	return rp;
+}
@@ -713,7 +713,7 @@ rowload(Row *row, char *file, int initing)
 				goto Rescue2;
 			t = emalloc(Blinelen(b)+1);
 			memmove(t, l, Blinelen(b));
-			run(nil, t, r, nr, TRUE, nil, nil, FALSE);
+			run(nil, t, r, nr, TRUE, nil, nil, FALSE, nil);
 			/* r is freed in run() */
 			goto Nextline;
 		case 'f':
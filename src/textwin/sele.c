@@ -105,7 +105,7 @@ putxsel(Text* t)
 		if(n > BUFSIZE/UTFmax)
 			n = BUFSIZE/UTFmax;
 		bufread(&t->file->b, q, r, n);
-		m = snprint(s, BUFSIZE+1, "%.*S", n, r);
+		m = cvttobytes(r, n, s);
 		if(write(pfd[1], s, m) != m)
 		{
 			warning(nil, "error writing to setguisel: %r\n");
@@ -261,7 +261,7 @@ newsel(Text* t)
 		if(n > BUFSIZE/UTFmax)
 			n = BUFSIZE/UTFmax;
 		bufread(&t->file->b, q, r, n);
-		m = snprint(s, BUFSIZE+1, "%.*S", n, r);
+		m = cvttobytes(r, n, s);
 		text = realloc(text, ntext + m);
 		memcpy(text + ntext, s, m);
 		ntext += m;
@@ -376,8 +376,10 @@ textinsert(Text *t, uint q0, Rune *r, uint n, int tofile)
 				if(u != t){
 					u->w->dirty = TRUE;	/* always a body */
 					textinsert(u, q0, r, n, FALSE);
-					textsetselect(u, u->q0, u->q1);
-					textscrdraw(u);
+					if(!u->nodraw){
+						textsetselect(u, u->q0, u->q1);
+						textscrdraw(u);
+					}
 				}
 			}
 					
@@ -388,7 +390,7 @@ textinsert(Text *t, uint q0, Rune *r, uint n, int tofile)
 		t->q0 += n;
 	if(q0 < t->org)
 		t->org += n;
-	else if(q0 <= t->org+t->fr.nchars)
+	else if(q0<=t->org+t->fr.nchars && !t->nodraw)
 		frinsert(&t->fr, r, r+n, q0-t->org);
 	if(t->w){
 		c = 'i';
@@ -418,7 +420,7 @@ textfill(Text *t)
 	Rune *rp;
 	int i, n, m, nl;
 
-	if(t->fr.lastlinefull || t->nofill)
+	if(t->fr.lastlinefull || t->nofill || t->nodraw)
 		return;
 	if(t->ncache > 0)
 		typecommit(t);
@@ -448,6 +450,20 @@ textfill(Text *t)
 	fbuffree(rp);
 }
 
+/*
+ * Redraw the frame of t from t->org after changes made with
+ * nodraw set, which moved only the origin and the selection.
+ */
+void
+textrefresh(Text *t)
+{
+	t->nodraw = FALSE;
+	if(t->org > t->file->b.nc)
+		t->org = t->file->b.nc;
+	frdelete(&t->fr, 0, t->fr.nchars);
+	textfill(t);
+}
+
 void
 textdelete(Text *t, uint q0, uint q1, int tofile)
 {
@@ -472,8 +488,10 @@ textdelete(Text *t, uint q0, uint q1, int tofile)
 				if(u != t){
 					u->w->dirty = TRUE;	/* always a body */
 					textdelete(u, q0, q1, FALSE);
-					textsetselect(u, u->q0, u->q1);
-					textscrdraw(u);
+					if(!u->nodraw){
+						textsetselect(u, u->q0, u->q1);
+						textscrdraw(u);
+					}
 				}
 			}
 	}
@@ -483,7 +501,10 @@ textdelete(Text *t, uint q0, uint q1, int tofile)
 		t->q1 -= min(n, t->q1-q0);
 	if(q1 <= t->org)
 		t->org -= n;
-	else if(q0 < t->org+t->fr.nchars){
+	else if(t->nodraw){
+		if(q0 < t->org)
+			t->org = q0;
+	}else if(q0 < t->org+t->fr.nchars){
 		p1 = q1 - t->org;
 		if(p1 > t->fr.nchars)
 			p1 = t->fr.nchars;
@@ -784,6 +805,7 @@ texttype(Text *t, Rune r)
 	if(t->what == Body){
 		seq++;
 		filemark(t->file);
+		t->file->joinseq = seq;
 	}
 	/* cut/paste must be done after the seq++/filemark */
 	switch(r){
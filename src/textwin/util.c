@@ -34,39 +34,6 @@ runestr(Rune *r, uint n)
 	return rs;
 }
 
-void
-cvttorunes(char *p, int n, Rune *r, int *nb, int *nr, int *nulls)
-{
-	uchar *q;
-	Rune *s;
-	int j, w;
-
-	/*
-	 * Always guaranteed that n bytes may be interpreted
-	 * without worrying about partial runes.  This may mean
-	 * reading up to UTFmax-1 more bytes than n; the caller
-	 * knows this.  If n is a firm limit, the caller should
-	 * set p[n] = 0.
-	 */
-	q = (uchar*)p;
-	s = r;
-	for(j=0; j<n; j+=w){
-		if(*q < Runeself){
-			w = 1;
-			*s = *q++;
-		}else{
-			w = chartorune(s, (char*)q);
-			q += w;
-		}
-		if(*s)
-			s++;
-		else if(nulls)
-			*nulls = TRUE;
-	}
-	*nb = (char*)q-p;
-	*nr = s-r;
-}
-
 void
 error(char *s)
 {
@@ -181,6 +148,7 @@ struct Warning{
 };
 
 static Warning *warnings;
+static QLock warnlk;	/* editprocs warn too */
 
 static
 void
@@ -188,9 +156,11 @@ addwarningtext(Mntdir *md, Rune *r, int nr)
 {
 	Warning *warn;
 	
+	qlock(&warnlk);
 	for(warn = warnings; warn; warn=warn->next){
 		if(warn->md == md){
 			bufinsert(&warn->buf, warn->buf.nc, r, nr);
+			qunlock(&warnlk);
 			return;
 		}
 	}
@@ -201,6 +171,7 @@ addwarningtext(Mntdir *md, Rune *r, int nr)
 		fsysincid(md);
 	warnings = warn;
 	bufinsert(&warn->buf, 0, r, nr);
+	qunlock(&warnlk);
 	nbsendp(cwarn, 0);
 }
 
@@ -277,6 +248,25 @@ runeeq(Rune *s1, uint n1, Rune *s2, uint n2)
 	return memcmp(s1, s2, n1*sizeof(Rune)) == 0;
 }
 
+/*
+ * Integer tunable from the environment, or def if unset.
+ */
+int
+envint(char *name, int def)
+{
+	char *p;
+	int n;
+
+	p = getenv(name);
+	if(p == nil)
+		return def;
+	n = def;
+	if(*p)
+		n = strtol(p, nil, 0);
+	free(p);
+	return n;
+}
+
 uint
 min(uint a, uint b)
 {
@@ -302,7 +292,7 @@ runetobyte(Rune *r, int n)
 		return nil;
 	s = emalloc(n*UTFmax+1);
 	setmalloctag(s, getcallerpc(&r));
-	snprint(s, n*UTFmax+1, "%.*S", n, r);
+	s[cvttobytes(r, n, s)] = 0;
 	return s;
 }
 
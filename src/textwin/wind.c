@@ -226,6 +226,28 @@ winlock(Window *w, int owner)
 		winlock1(f->text[i]->w, owner);
 }
 
+/* winlock, unless some other thread has w or one of its clones */
+int
+wincanlock(Window *w, int owner)
+{
+	int i;
+	File *f;
+
+	f = w->body.file;
+	for(i=0; i<f->ntext; i++)
+		if(!canqlock(&f->text[i]->w->lk)){
+			while(--i >= 0)
+				qunlock(&f->text[i]->w->lk);
+			return FALSE;
+		}
+	for(i=0; i<f->ntext; i++){
+		w = f->text[i]->w;
+		incref(&w->ref);
+		w->owner = owner;
+	}
+	return TRUE;
+}
+
 void
 winunlock(Window *w)
 {
@@ -625,11 +647,17 @@ winclean(Window *w, int conservative)	/* as it stands, conservative is always TR
 char*
 winctlprint(Window *w, char *buf, int fonts)
 {
+	File *f;
+
 	sprint(buf, "%11d %11d %11d %11d %11d ", w->id, w->tag.file->b.nc,
 		w->body.file->b.nc, w->isdir, w->dirty);
-	if(fonts)
-		return smprint("%s%11d %q %11d ", buf, Dx(w->body.fr.r), 
-			w->body.reffont->f->name, w->body.fr.maxtab);
+	if(fonts){
+		/* then the changes kept to undo and the bytes they take */
+		f = w->body.file;
+		return smprint("%s%11d %q %11d %11d %11lud ", buf, Dx(w->body.fr.r), 
+			w->body.reffont->f->name, w->body.fr.maxtab, f->nundop,
+			(ulong)(f->delta.nc+f->epsilon.nc)*sizeof(Rune));
+	}
 	return buf;
 }
 
@@ -13,7 +13,8 @@
 
 enum
 {
-	Ctlsize	= 5*12
+	Ctlsize	= 5*12,
+	Matchsize	= 2*12	/* bytes per line of matches */
 };
 
 char	Edel[]		= "deleted window";
@@ -22,6 +23,8 @@ char	Ebadaddr[]	= "bad address syntax";
 char	Eaddr[]		= "address out of range";
 char	Einuse[]		= "already in use";
 char	Ebadevent[]	= "bad event syntax";
+char	Ebadregexp[]	= "bad regular expression";
+char	Enoregexp[]	= "no regular expression";
 extern char Eperm[];
 
 static
@@ -110,6 +113,7 @@ xfidopen(Xfid *x)
 			break;
 		case QWdata:
 		case QWxdata:
+		case QWmatches:
 			w->nopen[q]++;
 			break;
 		case QWevent:
@@ -250,6 +254,16 @@ xfidclose(Xfid *x)
 				}
 			}
 			break;
+		case QWmatches:
+			if(--w->nopen[q] == 0){
+				if(w->matchre != nil)
+					rxfree(w->matchre);
+				free(w->matches);
+				w->matchre = nil;
+				w->matches = nil;
+				w->nmatches = 0;
+			}
+			break;
 		case QWrdsel:
 			close(w->rdselfd);
 			w->rdselfd = 0;
@@ -300,6 +314,9 @@ xfidread(Xfid *x)
 		case Qindex:
 			xfidindexread(x);
 			return;
+		case Qstats:
+			xfidstatsread(x);
+			return;
 		default:
 			warning(nil, "unknown qid %d\n", q);
 			break;
@@ -348,6 +365,10 @@ xfidread(Xfid *x)
 		xfideventread(x, w);
 		break;
 
+	case QWmatches:
+		xfidmatchesread(x, w);
+		break;
+
 	case QWdata:
 		/* BUG: what should happen if q1 > q0? */
 		if(w->addr.q0 > w->body.file->b.nc){
@@ -405,6 +426,7 @@ xfidwrite(Xfid *x)
 	Rune *r;
 	Range a;
 	Text *t;
+	Regexp *re;
 	uint q0, tq0, tq1;
 
 	qid = FILE(x->f->qid);
@@ -496,6 +518,7 @@ xfidwrite(Xfid *x)
 		if(w->nomark == FALSE){
 			seq++;
 			filemark(t->file);
+			t->file->joinseq = seq;
 		}
 		q0 = a.q0;
 		if(a.q1 > q0){
@@ -525,6 +548,28 @@ xfidwrite(Xfid *x)
 		xfideventwrite(x, w);
 		break;
 
+	case QWmatches:
+		r = bytetorune(x->fcall.data, &nr);
+		if(nr>0 && r[nr-1]=='\n')
+			r[--nr] = '\0';
+		re = nil;
+		if(nr > 0)
+			re = rxcompile(r);
+		free(r);
+		if(re == nil){
+			respond(x, &fc, Ebadregexp);
+			break;
+		}
+		if(w->matchre != nil)
+			rxfree(w->matchre);
+		free(w->matches);
+		w->matchre = re;
+		w->matches = nil;
+		w->nmatches = 0;
+		fc.count = x->fcall.count;
+		respond(x, &fc, nil);
+		break;
+
 	case QWtag:
 		t = &w->tag;
 		goto BodyTag;
@@ -596,8 +641,10 @@ xfidctlwrite(Xfid *x, Window *w)
 	Fcall fc;
 	int i, m, n, nb, nr, nulls;
 	Rune *r;
-	char *err, *p, *pp, *q, *e;
+	char *err, *p, *pp, *q, *e, *s;
 	int isfbuf, scrdraw, settag;
+	long nch;
+	vlong nby;
 	Text *t;
 
 	err = nil;
@@ -709,6 +756,32 @@ out:
 			w->dumpdir = runetobyte(r, nr);
 			m += (q+1) - pp;
 		}else
+		if(strncmp(p, "undo ", 5) == 0){	/* set undo budget: changes, bytes */
+			pp = p+5;
+			m = 5;
+			q = memchr(pp, '\n', e-pp);
+			if(q==nil || q==pp){
+				err = Ebadctl;
+				break;
+			}
+			*q = 0;
+			nch = strtol(pp, &s, 0);
+			nby = -1;
+			if(s != pp){
+				pp = s;
+				nby = strtoll(pp, &s, 0);
+				if(s == pp)
+					nby = -1;
+			}
+			while(*s==' ' || *s=='\t')
+				s++;
+			if(*s || nch<0 || nch>0x7FFFFFFF || nby<0 || nby>0xFFFFFFFFLL){
+				err = Ebadctl;
+				break;
+			}
+			filebudget(w->body.file, nch, nby);
+			m = (q+1) - p;
+		}else
 		if(strncmp(p, "delete", 6) == 0){	/* delete for sure */
 			colclose(w->col, w, TRUE);
 			m = 6;
@@ -924,7 +997,7 @@ xfidutfread(Xfid *x, Text *t, uint q1, int qid)
 		if(nr > BUFSIZE/UTFmax)
 			nr = BUFSIZE/UTFmax;
 		bufread(&t->file->b, q, r, nr);
-		nb = snprint(b, BUFSIZE+1, "%.*S", nr, r);
+		nb = cvttobytes(r, nr, b);
 		if(boff >= off){
 			m = nb;
 			if(boff+m > off+x->fcall.count)
@@ -974,7 +1047,7 @@ xfidruneread(Xfid *x, Text *t, uint q0, uint q1)
 		if(nr > BUFSIZE/UTFmax)
 			nr = BUFSIZE/UTFmax;
 		bufread(&t->file->b, q, r, nr);
-		nb = snprint(b, BUFSIZE+1, "%.*S", nr, r);
+		nb = cvttobytes(r, nr, b);
 		m = nb;
 		if(boff+m > x->fcall.count){
 			i = x->fcall.count - boff;
@@ -1101,3 +1174,66 @@ xfidindexread(Xfid *x)
 	respond(x, &fc, nil);
 	fbuffree(r);
 }
+
+void
+xfidstatsread(Xfid *x)
+{
+	Fcall fc;
+	char *b, *p;
+	int n, off, cnt;
+
+	b = fbufalloc();
+	p = diskstats(disk, b, b+BUFSIZE);
+	p = rxstats(p, b+BUFSIZE);
+	n = p-b;
+	off = x->fcall.offset;
+	cnt = x->fcall.count;
+	if(off > n)
+		off = n;
+	if(off+cnt > n)
+		cnt = n-off;
+	fc.count = cnt;
+	fc.data = b+off;
+	respond(x, &fc, nil);
+	fbuffree(b);
+}
+
+/*
+ * The matches of the expression written to the file, one line of
+ * two offsets each, found afresh in the whole body by a read from
+ * the start and kept for the reads after it.
+ */
+void
+xfidmatchesread(Xfid *x, Window *w)
+{
+	Fcall fc;
+	Text *t;
+	char *b;
+	int i, n, off, cnt;
+
+	if(w->matchre == nil){
+		respond(x, &fc, Enoregexp);
+		return;
+	}
+	off = x->fcall.offset;
+	if(off==0 || w->matches==nil){
+		t = &w->body;
+		textcommit(t, TRUE);
+		free(w->matches);
+		w->matches = rxmatches(w->matchre, t, 0, t->file->b.nc, FALSE, &w->nmatches);
+	}
+	b = fbufalloc();
+	n = 0;
+	for(i=off/Matchsize; i<w->nmatches && n+Matchsize<=BUFSIZE; i++)
+		n += sprint(b+n, "%11d %11d\n", w->matches[i].q0, w->matches[i].q1);
+	off %= Matchsize;
+	cnt = x->fcall.count;
+	if(off > n)
+		off = n;
+	if(off+cnt > n)
+		cnt = n-off;
+	fc.count = cnt;
+	fc.data = b+off;
+	respond(x, &fc, nil);
+	fbuffree(b);
+}